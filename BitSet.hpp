@@ -1,5 +1,9 @@
 #pragma once
 
+#ifdef HWBP_DEBUG
+#include <iostream>
+#endif
+
 //
 // Limited to 64 bits
 //
@@ -30,7 +34,7 @@ public:
 
     constexpr void SetBit(std::size_t idx, const bool value) noexcept
     {
-        auto pos = static_cast<decltype(_v)>(1 << idx);
+        auto pos = static_cast<decltype(_v)>(std::uint64_t{ 1 } << idx);
 
         if (value)
             _v |= pos;
@@ -45,7 +49,7 @@ public:
 
     constexpr void FlipBit(std::size_t idx) noexcept
     {
-        auto pos = static_cast<decltype(_v)>(1 << idx);
+        auto pos = static_cast<decltype(_v)>(std::uint64_t{ 1 } << idx);
 
         _v ^= pos;
     }
@@ -57,17 +61,18 @@ public:
 
     constexpr bool IsBitSet(std::size_t idx) const noexcept
     {
-        return (_v & static_cast<decltype(_v)>(1 << idx)) != 0;
+        return (_v & static_cast<decltype(_v)>(std::uint64_t{ 1 } << idx)) != 0;
     }
 
 
     constexpr auto ExtractBits(std::size_t start_idx, std::size_t end_idx) const noexcept
     {
-        auto mask = ((1 << ((1 + end_idx) - start_idx)) - 1) << start_idx;
+        auto mask = ((std::uint64_t{ 1 } << ((1 + end_idx) - start_idx)) - 1) << start_idx;
 
         return (mask & _v);
     }
 
+#ifdef HWBP_DEBUG
     void PrintBits(bool nibbled = false) const
     {
         int idx{ bits };
@@ -85,6 +90,7 @@ public:
 
         std::cout << std::endl;
     }
+#endif
 
     constexpr auto ToValue() const noexcept
     {
@@ -0,0 +1,405 @@
+#pragma once
+
+#include <cctype>
+#include <charconv>
+
+//
+// Condition a hit has to meet before the breakpoint's handler runs, compiled once from text
+// into a few bytes of stack machine code the exception handler walks without allocating.
+//
+//	rdx == 0x7ff6a000 && dword[rcx + 8] > 10
+//
+// Operands are numbers (decimal or 0x hex), registers under their CONTEXT names (rax ... r15,
+// rip and eflags on x64, eax ... edi, eip and eflags on x86) and memory, read as
+// byte/word/dword/qword[...] (pointer sized without a prefix). Operators, loosest first:
+// || and &&, the comparisons == != < <= > >= (unsigned), + - &, and a prefix !. Both sides
+// of || and && are always evaluated. Memory is read without trusting the address, a read
+// that fails makes the whole condition false.
+//
+class BreakpointFilter
+{
+public:
+	static constexpr std::size_t MaxInsns = 32;
+	static constexpr std::size_t MaxStack = 8;
+
+	BreakpointFilter() = default;
+
+	//! Compile `text`, on failure the filter is left empty (every hit matches)
+	bool Compile(std::string_view text) noexcept
+	{
+		Compiler compiler{ *this, text };
+
+		m_count = 0;
+
+		if (!compiler.Expr() || !compiler.End())
+		{
+			FormatError("[!] Invalid breakpoint filter at offset {}: {}\n", compiler.m_pos, text);
+			m_count = 0;
+			return false;
+		}
+
+		return true;
+	}
+
+	//! Whether a condition is set
+	explicit operator bool() const noexcept
+	{
+		return m_count != 0;
+	}
+
+	//! Run the condition on the context of a hit
+	template<typename Context>
+	bool Evaluate(Context* ctx) const noexcept;
+
+private:
+	enum class Op : std::uint8_t
+	{
+		Imm,	// push m_imm
+		Reg,	// push register m_arg (rax = 0 ... r15 = 15, RegIp, RegFlags)
+		Load,	// replace the address on top with the m_arg bytes it points at
+		Not,
+		Add, Sub, And,
+		Eq, Ne, Lt, Le, Gt, Ge,
+		LogAnd, LogOr
+	};
+
+	struct Insn
+	{
+		Op				m_op{};
+		std::uint8_t	m_arg{};
+		std::uint64_t	m_imm{};
+	};
+
+	static constexpr std::uint8_t RegIp = 16;
+	static constexpr std::uint8_t RegFlags = 17;
+
+	//! Read `size` bytes at `address` without faulting on a bad one
+	static bool ReadMemory(std::uintptr_t address, std::uint8_t size, std::uint64_t& value) noexcept
+	{
+		value = 0;
+
+#if defined(HWBP_WINDOWS)
+		SIZE_T read{};
+		return ReadProcessMemory(GetCurrentProcess(), (LPCVOID)address, &value, size, &read) && read == size;
+#else
+		iovec local{ &value, size };
+		iovec remote{ (void*)address, size };
+		return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) == static_cast<ssize_t>(size);
+#endif
+	}
+
+	//
+	// Recursive descent over the grammar, emitting into the filter as it goes
+	//
+	struct Compiler
+	{
+		BreakpointFilter&	m_filter;
+		std::string_view	m_text;
+		std::size_t			m_pos{};
+		//! Values on the stack at this point of the program
+		std::size_t			m_stack{};
+
+		bool Emit(Op op, std::uint8_t arg = 0, std::uint64_t imm = 0) noexcept
+		{
+			if (m_filter.m_count == MaxInsns)
+				return false;
+
+			if (op == Op::Imm || op == Op::Reg)
+			{
+				if (++m_stack > MaxStack)
+					return false;
+			}
+			else if (op != Op::Load && op != Op::Not)
+			{
+				m_stack--;
+			}
+
+			m_filter.m_insns[m_filter.m_count++] = { op, arg, imm };
+			return true;
+		}
+
+		void Skip() noexcept
+		{
+			while (m_pos < m_text.size() && (m_text[m_pos] == ' ' || m_text[m_pos] == '\t'))
+				m_pos++;
+		}
+
+		//! Consume `token` if it comes next
+		bool Accept(std::string_view token) noexcept
+		{
+			Skip();
+
+			if (m_text.substr(m_pos, token.size()) != token)
+				return false;
+
+			m_pos += token.size();
+			return true;
+		}
+
+		bool End() noexcept
+		{
+			Skip();
+			return m_pos == m_text.size();
+		}
+
+		std::string_view Identifier() noexcept
+		{
+			Skip();
+
+			const std::size_t begin = m_pos;
+			while (m_pos < m_text.size() && (std::isalnum(static_cast<unsigned char>(m_text[m_pos])) || m_text[m_pos] == '_'))
+				m_pos++;
+
+			return m_text.substr(begin, m_pos - begin);
+		}
+
+		static int Register(std::string_view name) noexcept
+		{
+#if defined(HWBP_X64)
+			constexpr std::string_view names[] = {
+				"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+				"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15", "rip", "eflags"
+			};
+#else
+			constexpr std::string_view names[] = {
+				"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+				"", "", "", "", "", "", "", "", "eip", "eflags"
+			};
+#endif
+			for (int i = 0; i < static_cast<int>(std::size(names)); i++)
+			{
+				if (!names[i].empty() && names[i] == name)
+					return i;
+			}
+
+			return -1;
+		}
+
+		static std::uint8_t LoadSize(std::string_view name) noexcept
+		{
+			if (name == "byte")
+				return 1;
+			if (name == "word")
+				return 2;
+			if (name == "dword")
+				return 4;
+			if (name == "qword")
+				return 8;
+
+			return 0;
+		}
+
+		bool Expr() noexcept
+		{
+			if (!AndExpr())
+				return false;
+
+			while (Accept("||"))
+			{
+				if (!AndExpr() || !Emit(Op::LogOr))
+					return false;
+			}
+
+			return true;
+		}
+
+		bool AndExpr() noexcept
+		{
+			if (!Compare())
+				return false;
+
+			while (Accept("&&"))
+			{
+				if (!Compare() || !Emit(Op::LogAnd))
+					return false;
+			}
+
+			return true;
+		}
+
+		bool Compare() noexcept
+		{
+			if (!Sum())
+				return false;
+
+			//
+			// Two character operators first, "<" would match the start of "<="
+			constexpr std::pair<std::string_view, Op> ops[] = {
+				{ "==", Op::Eq }, { "!=", Op::Ne }, { "<=", Op::Le }, { ">=", Op::Ge }, { "<", Op::Lt }, { ">", Op::Gt }
+			};
+
+			for (const auto& [token, op] : ops)
+			{
+				if (Accept(token))
+					return Sum() && Emit(op);
+			}
+
+			return true;
+		}
+
+		bool Sum() noexcept
+		{
+			if (!Unary())
+				return false;
+
+			while (true)
+			{
+				Op op{};
+
+				if (Accept("+"))
+					op = Op::Add;
+				else if (Accept("-"))
+					op = Op::Sub;
+				else if (Accept("&&"))
+				{
+					m_pos -= 2;
+					return true;
+				}
+				else if (Accept("&"))
+					op = Op::And;
+				else
+					return true;
+
+				if (!Unary() || !Emit(op))
+					return false;
+			}
+		}
+
+		bool Unary() noexcept
+		{
+			//
+			// "!=" only ever follows an operand, here "!" is always a prefix
+			if (Accept("!"))
+				return Unary() && Emit(Op::Not);
+
+			return Atom();
+		}
+
+		bool Atom() noexcept
+		{
+			if (Accept("("))
+				return Expr() && Accept(")");
+
+			if (Accept("["))
+				return Sum() && Accept("]") && Emit(Op::Load, sizeof(std::uintptr_t));
+
+			Skip();
+
+			if (m_pos < m_text.size() && std::isdigit(static_cast<unsigned char>(m_text[m_pos])))
+			{
+				const bool hex = Accept("0x");
+				const char* first = m_text.data() + m_pos;
+
+				std::uint64_t value{};
+				const auto [ptr, ec] = std::from_chars(first, m_text.data() + m_text.size(), value, hex ? 16 : 10);
+				if (ec != std::errc{})
+					return false;
+
+				m_pos += ptr - first;
+				return Emit(Op::Imm, 0, value);
+			}
+
+			const std::size_t begin = m_pos;
+			const std::string_view name = Identifier();
+
+			if (const int reg = Register(name); reg >= 0)
+				return Emit(Op::Reg, static_cast<std::uint8_t>(reg));
+
+			if (const std::uint8_t size = LoadSize(name); size != 0 && Accept("["))
+				return Sum() && Accept("]") && Emit(Op::Load, size);
+
+			m_pos = begin;
+			return false;
+		}
+	};
+
+private:
+	Insn			m_insns[MaxInsns]{};
+	std::uint8_t	m_count{};
+};
+
+template<typename Context>
+inline bool BreakpointFilter::Evaluate(Context* ctx) const noexcept
+{
+	std::uint64_t stack[MaxStack];
+	std::size_t top = 0;
+
+	for (std::size_t i = 0; i < m_count; i++)
+	{
+		const Insn& insn = m_insns[i];
+
+		switch (insn.m_op)
+		{
+		case Op::Imm:
+			stack[top++] = insn.m_imm;
+			continue;
+		case Op::Reg:
+			if (insn.m_arg == RegIp)
+#if defined(HWBP_X64)
+				stack[top++] = static_cast<std::uint64_t>(ctx->Rip);
+#else
+				stack[top++] = static_cast<std::uint32_t>(ctx->Eip);
+#endif
+			else if (insn.m_arg == RegFlags)
+				stack[top++] = static_cast<std::uint32_t>(ctx->EFlags);
+			else
+				stack[top++] = static_cast<std::uintptr_t>(HwbpDetail::ContextRegister(ctx, insn.m_arg));
+			continue;
+		case Op::Load:
+			if (!ReadMemory(static_cast<std::uintptr_t>(stack[top - 1]), insn.m_arg, stack[top - 1]))
+				return false;
+			continue;
+		case Op::Not:
+			stack[top - 1] = stack[top - 1] == 0;
+			continue;
+		default:
+			break;
+		}
+
+		//
+		// Binary operators
+		const std::uint64_t b = stack[--top];
+		std::uint64_t& a = stack[top - 1];
+
+		switch (insn.m_op)
+		{
+		case Op::Add:
+			a += b;
+			break;
+		case Op::Sub:
+			a -= b;
+			break;
+		case Op::And:
+			a &= b;
+			break;
+		case Op::Eq:
+			a = a == b;
+			break;
+		case Op::Ne:
+			a = a != b;
+			break;
+		case Op::Lt:
+			a = a < b;
+			break;
+		case Op::Le:
+			a = a <= b;
+			break;
+		case Op::Gt:
+			a = a > b;
+			break;
+		case Op::Ge:
+			a = a >= b;
+			break;
+		case Op::LogAnd:
+			a = a != 0 && b != 0;
+			break;
+		case Op::LogOr:
+			a = a != 0 || b != 0;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return stack[0] != 0;
+}
@@ -1,12 +1,29 @@
 #pragma once
 
 #include <string_view>
+#if defined(HWBP_LOG_SINK)
 #include <format>
+#elif defined(HWBP_DEBUG)
+#include <format>
+#include <iostream>
+#endif
+
+//
+// Messages go to HWBP_LOG_SINK if the library was built with one, in any build:
+//	-DHWBP_LOG_SINK=MyLog, with `void MyLog(bool error, std::string_view message)` defined
+// by the application. Without a sink debug builds print them and release builds drop them
+// without formatting anything.
+//
+#if defined(HWBP_LOG_SINK)
+void HWBP_LOG_SINK(bool error, std::string_view message);
+#endif
  
 template< class... Args >
 __forceinline void FormatError(std::string_view fmt, Args&&... args) noexcept
 {
-#ifdef HWBP_DEBUG
+#if defined(HWBP_LOG_SINK)
+    HWBP_LOG_SINK(true, std::vformat(fmt, std::make_format_args(args...)));
+#elif defined(HWBP_DEBUG)
     std::cerr << std::format(fmt, std::forward<Args>(args)...);
 #endif
 }
@@ -14,7 +31,19 @@ __forceinline void FormatError(std::string_view fmt, Args&&... args) noexcept
 template<class... Args>
 __forceinline void FormatMsg(std::string_view fmt, Args&&... args) noexcept
 {
-#ifdef HWBP_DEBUG
+#if defined(HWBP_LOG_SINK)
+    HWBP_LOG_SINK(false, std::vformat(fmt, std::make_format_args(args...)));
+#elif defined(HWBP_DEBUG)
     std::cout << std::format(fmt, std::forward<Args>(args)...);
 #endif
+}
+
+//! Last error code of the platform, for error messages
+__forceinline unsigned long HwbpLastError() noexcept
+{
+#if defined(HWBP_WINDOWS)
+    return GetLastError();
+#else
+    return static_cast<unsigned long>(errno);
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+template<typename Sig, std::size_t Capacity = 6 * sizeof(void*)>
+class TDelegate;
+
+//
+// Callable wrapper that never allocates: the target lives in an inline buffer and a
+// target that doesn't fit is a compile error instead of a heap allocation. Calls go
+// through a single function pointer, Bind<&Fn>() produces one that calls Fn directly
+// without storing anything.
+//
+template<typename R, typename... Args, std::size_t Capacity>
+class TDelegate<R(Args...), Capacity>
+{
+	enum class Op : std::uint8_t
+	{
+		Copy,
+		Move,
+		Destroy
+	};
+
+	using Invoke_t = R(*)(void*, Args...);
+	using Manage_t = void(*)(Op, void*, void*) noexcept;
+
+public:
+	TDelegate() noexcept = default;
+
+	TDelegate(std::nullptr_t) noexcept
+	{
+	}
+
+	template<typename F>
+		requires (!std::is_same_v<std::decay_t<F>, TDelegate> && std::is_invocable_r_v<R, std::decay_t<F>&, Args...>)
+	TDelegate(F&& f) noexcept(std::is_nothrow_constructible_v<std::decay_t<F>, F&&>)
+	{
+		using T = std::decay_t<F>;
+
+		static_assert(sizeof(T) <= Capacity, "Handler captures too much for the delegate's inline storage");
+		static_assert(alignof(T) <= alignof(std::max_align_t), "Handler is over-aligned");
+		static_assert(std::is_copy_constructible_v<T> && std::is_nothrow_move_constructible_v<T>, "Handler must be copyable and nothrow movable");
+
+		new (m_storage) T(std::forward<F>(f));
+
+		m_invoke = [](void* p, Args... args) -> R
+		{
+			return (*static_cast<T*>(p))(std::forward<Args>(args)...);
+		};
+
+		if constexpr (!std::is_trivially_copyable_v<T> || !std::is_trivially_destructible_v<T>)
+			m_manage = &Manage<T>;
+	}
+
+	TDelegate(const TDelegate& other)
+	{
+		Assign(other, Op::Copy);
+	}
+
+	TDelegate(TDelegate&& other) noexcept
+	{
+		Assign(other, Op::Move);
+	}
+
+	TDelegate& operator=(const TDelegate& other)
+	{
+		if (this != &other)
+		{
+			Reset();
+			Assign(other, Op::Copy);
+		}
+
+		return *this;
+	}
+
+	TDelegate& operator=(TDelegate&& other) noexcept
+	{
+		if (this != &other)
+		{
+			Reset();
+			Assign(other, Op::Move);
+		}
+
+		return *this;
+	}
+
+	~TDelegate()
+	{
+		Reset();
+	}
+
+	//! Delegate calling `Fn` directly, nothing is stored
+	template<auto Fn>
+	static TDelegate Bind() noexcept
+	{
+		TDelegate delegate;
+
+		delegate.m_invoke = [](void*, Args... args) -> R
+		{
+			return Fn(std::forward<Args>(args)...);
+		};
+
+		return delegate;
+	}
+
+	explicit operator bool() const noexcept
+	{
+		return m_invoke != nullptr;
+	}
+
+	R operator()(Args... args) const
+	{
+		return m_invoke(const_cast<unsigned char*>(m_storage), std::forward<Args>(args)...);
+	}
+
+private:
+	template<typename T>
+	static void Manage(Op op, void* dst, void* src) noexcept
+	{
+		switch (op)
+		{
+		case Op::Copy:
+			new (dst) T(*static_cast<const T*>(src));
+			break;
+		case Op::Move:
+			new (dst) T(std::move(*static_cast<T*>(src)));
+			break;
+		case Op::Destroy:
+			static_cast<T*>(dst)->~T();
+			break;
+		}
+	}
+
+	//! Copy or move the target of `other` into our (empty) storage
+	void Assign(const TDelegate& other, Op op) noexcept
+	{
+		m_invoke = other.m_invoke;
+		m_manage = other.m_manage;
+
+		if (m_manage)
+			m_manage(op, m_storage, const_cast<unsigned char*>(other.m_storage));
+		else
+			std::memcpy(m_storage, other.m_storage, Capacity);
+	}
+
+	void Reset() noexcept
+	{
+		if (m_manage)
+			m_manage(Op::Destroy, m_storage, nullptr);
+
+		m_invoke = nullptr;
+		m_manage = nullptr;
+	}
+
+private:
+	alignas(std::max_align_t) unsigned char m_storage[Capacity]{};
+	Invoke_t m_invoke{};
+	//! Copy/move/destroy for targets that aren't trivial, null otherwise
+	Manage_t m_manage{};
+};
@@ -4,12 +4,19 @@
 
 namespace HwbpDetail
 {
-#if defined(HWBP_X64)
-	static constexpr auto JMP_LEN = 14;	
-#else
+	//
+	// The export is patched with a rel32 jmp, to a relay stub in the arena if the hook itself is out of reach
 	static constexpr auto JMP_LEN = 5;
-#endif
-	inline std::map<void*, std::vector<uint8_t>> HookMap;
+
+	struct HookEntry
+	{
+		//! Bytes overwritten at the export
+		std::vector<uint8_t> m_original;
+		//! Trampoline (stolen bytes + jmp back) followed by the relay to the hook
+		ScopedMemory m_stub;
+	};
+
+	inline std::map<void*, HookEntry> HookMap;
 }
 
 
@@ -48,76 +55,79 @@ static void* HookExportDirect(
 			// This function needs a revisit, it's poorly coded and not safe in the slightest
 			//
 			hde_t hde{};
-			std::size_t total_len{ 0 }, in_len{ 0 }, tmp_len{ 0 };
-			uint8_t buffer[0x20]{};
+			std::size_t total_len{ 0 }, in_len{ 0 }, out_len{ 0 };
+			uint8_t buffer[HwbpDetail::MaxRelocatedLength * HwbpDetail::JMP_LEN + TrampolineArena::MaxJumpLength * 2]{};
 			uint8_t hook_buffer[HwbpDetail::JMP_LEN]{};
 
 			void* pAddress = (void*)(pImg + pAddressTable[pOrdinalTable[i]]);
 			std::uint8_t* pTmp = (std::uint8_t*)pAddress;
 
+			//
+			// Trampoline and relay share one arena stub within rel32 reach of the export
+			ScopedMemory stub{ sizeof(buffer), pAddress };
+			if (!stub.valid())
+				return nullptr;
+
+			const auto pTramp = (std::uintptr_t)stub.buffer();
+
 			do
 			{
 				in_len = hde_disasm(pTmp, &hde);
-				memcpy(&buffer[total_len], pTmp, in_len);
+
+				//
+				// Stolen instructions are rewritten to run from the trampoline
+				const auto rel_len = HwbpDetail::RelocateInstruction(pTmp, hde, &buffer[out_len], pTramp + out_len);
+				if (rel_len == 0)
+					return nullptr;
+
+				out_len += rel_len;
 				total_len += in_len;
 				pTmp += in_len;
 			} while (total_len < HwbpDetail::JMP_LEN);
 
 			//
-			// Add to the hook map
-			HwbpDetail::HookMap[pAddress] = std::vector<uint8_t>(total_len);
-			memcpy(&HwbpDetail::HookMap[pAddress][0], pAddress, total_len);
+			// Assemble trampoline, jump back past the stolen instructions
+			const auto tramp_len = out_len +
+				TrampolineArena::EmitJump(&buffer[out_len], pTramp + out_len, (std::uintptr_t)pAddress + total_len);
 
-
-			//
-			// Assemble trampoline
-			void* pTramp = VirtualAlloc(nullptr, sizeof buffer, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
-			if (!pTramp)
-				return nullptr;
-				
 			//
-			// Call our hook
-#if defined(HWBP_X64)
-			buffer[total_len] = 0x49; // (rely on register r10..)
-			buffer[total_len+1] = 0xba;
-			*(std::uintptr_t*)(&buffer[total_len+2]) = (std::uintptr_t)pAddress + HwbpDetail::JMP_LEN;
-			buffer[total_len + 10] = 0x41;
-			buffer[total_len + 11] = 0xff;
-			buffer[total_len + 12] = 0xe2;
-#else
-			buffer[total_len] = 0xe9;
-			*(std::uint32_t*)(&buffer[total_len + 1]) =
-				(((std::uintptr_t)pAddress + 5) - ((std::uintptr_t)pTramp + total_len + 5));
-#endif
-
-			memcpy(pTramp, buffer, sizeof(buffer));
+			// Assemble relay to our hook, skipped when the hook is directly reachable
+			std::uintptr_t pTarget = (std::uintptr_t)pHook;
+
+			if (!TrampolineArena::InRel32((std::uintptr_t)pAddress + HwbpDetail::JMP_LEN, pTarget))
+			{
+				pTarget = pTramp + tramp_len;
+				const auto relay_len = TrampolineArena::EmitJump(&buffer[tramp_len], pTarget, (std::uintptr_t)pHook);
+				stub.copy(buffer, tramp_len + relay_len);
+			}
+			else
+			{
+				stub.copy(buffer, tramp_len);
+			}
+
+			TrampolineArena::Get().Seal();
 
 			// 
-			// Assemble a jmp to trampoline
-#if defined(HWBP_X64)
-			hook_buffer[0] = 0x49; // (rely on register r10..)
-			hook_buffer[1] = 0xba;
-			*(std::uintptr_t*)(&hook_buffer[2]) = (std::uintptr_t)pHook;
-			hook_buffer[10] = 0x41;
-			hook_buffer[11] = 0xff;
-			hook_buffer[12] = 0xe2;
-#else
-			hook_buffer[0] = 0xe9;
-			*(std::uint32_t*)(&hook_buffer[1]) = ((std::uintptr_t)pHook - ((std::uintptr_t)pAddress + 5));
-#endif
+			// Assemble a jmp to our hook (or relay)
+			TrampolineArena::EmitJump(hook_buffer, (std::uintptr_t)pAddress, pTarget);
+
 			if (!VirtualProtect(pAddress, sizeof(hook_buffer), PAGE_EXECUTE_READWRITE, &prot))
-			{
-				VirtualFree(pTramp, 0, MEM_RELEASE);
 				return nullptr;
-			}
+
+			//
+			// Add to the hook map
+			auto& entry = HwbpDetail::HookMap[pAddress];
+			entry.m_original.assign((std::uint8_t*)pAddress, (std::uint8_t*)pAddress + sizeof(hook_buffer));
+			entry.m_stub = std::move(stub);
 
 			memcpy(pAddress, hook_buffer, sizeof(hook_buffer));
 			VirtualProtect(pAddress, sizeof(hook_buffer), prot, &prot);
+			FlushInstructionCache(GetCurrentProcess(), pAddress, sizeof(hook_buffer));
 
 			if (pfnOriginal)
-				*pfnOriginal = pTramp;
+				*pfnOriginal = (void*)pTramp;
 
-			return pTramp;
+			return (void*)pTramp;
 		}
 	}
 
@@ -155,13 +165,16 @@ static void UnHookExportDirect(
 
 			if (it != HwbpDetail::HookMap.end())
 			{
-				if (!VirtualProtect(pAddress, it->second.size(), PAGE_EXECUTE_READWRITE, &prot))
+				const auto& original = it->second.m_original;
+
+				if (!VirtualProtect(pAddress, original.size(), PAGE_EXECUTE_READWRITE, &prot))
 				{
 					return;
 				}
 
-				memcpy(pAddress, it->second.data(), it->second.size());
-				VirtualProtect(pAddress, it->second.size(), prot, &prot);
+				memcpy(pAddress, original.data(), original.size());
+				VirtualProtect(pAddress, original.size(), prot, &prot);
+				FlushInstructionCache(GetCurrentProcess(), pAddress, original.size());
 
 				HwbpDetail::HookMap.erase(it);
 			}
@@ -0,0 +1,252 @@
+#pragma once
+
+//
+// Executes a few common prologue instructions (push reg, mov reg, reg and sub rsp, imm)
+// straight on a thread context, so an execute breakpoint can resume past them without
+// running anything out of place. The context type only needs the Windows CONTEXT register
+// names, which HwbpContext mirrors on Linux.
+//
+namespace HwbpDetail
+{
+	enum class EmulatedOp : std::uint8_t
+	{
+		None,
+		Push,	// push m_src
+		Mov,	// mov m_dst, m_src
+		SubSp	// sub rsp, m_imm
+	};
+
+	struct EmulatedInstruction
+	{
+		EmulatedOp		m_op{};
+		//! Register numbers as encoded (rax = 0 ... r15 = 15)
+		std::uint8_t	m_dst{};
+		std::uint8_t	m_src{};
+		//! 32 bit mov on x64, the result is zero extended
+		bool			m_narrow{};
+		std::uint8_t	m_length{};
+		std::int32_t	m_imm{};
+	};
+
+	//! Recognize an instruction EmulateInstruction can run, m_op is None for anything else
+	inline EmulatedInstruction DecodeEmulated(const hde_t& hde) noexcept
+	{
+		EmulatedInstruction insn{};
+
+		//
+		// Operand size, address size and segment prefixes are all out of scope
+#if defined(HWBP_X64)
+		if (hde.flags & (F_ERROR | (F_PREFIX_ANY & ~F_PREFIX_REX)))
+			return insn;
+
+		const std::uint8_t rexR = hde.rex_r << 3;
+		const std::uint8_t rexB = hde.rex_b << 3;
+		const bool wide = hde.rex_w != 0;
+#else
+		if (hde.flags & (F_ERROR | F_PREFIX_ANY))
+			return insn;
+
+		const std::uint8_t rexR = 0;
+		const std::uint8_t rexB = 0;
+		const bool wide = true;
+#endif
+
+		insn.m_length = hde.len;
+
+		if (hde.opcode >= 0x50 && hde.opcode <= 0x57)
+		{
+			insn.m_op = EmulatedOp::Push;
+			insn.m_src = (hde.opcode & 7) | rexB;
+		}
+		else if ((hde.opcode == 0x89 || hde.opcode == 0x8b) && hde.modrm_mod == 3)
+		{
+			const std::uint8_t reg = hde.modrm_reg | rexR;
+			const std::uint8_t rm = hde.modrm_rm | rexB;
+
+			//
+			// 89 /r: mov r/m, reg. 8b /r: mov reg, r/m
+			insn.m_op = EmulatedOp::Mov;
+			insn.m_dst = hde.opcode == 0x89 ? rm : reg;
+			insn.m_src = hde.opcode == 0x89 ? reg : rm;
+			insn.m_narrow = !wide;
+		}
+		else if ((hde.opcode == 0x83 || hde.opcode == 0x81) && hde.modrm_mod == 3 && hde.modrm_reg == 5 && (hde.modrm_rm | rexB) == 4 && wide)
+		{
+			insn.m_op = EmulatedOp::SubSp;
+			insn.m_imm = hde.opcode == 0x83 ? static_cast<std::int8_t>(hde.imm.imm8) : static_cast<std::int32_t>(hde.imm.imm32);
+		}
+
+		return insn;
+	}
+
+	//! General purpose register `reg` (as encoded) of a context
+	template<typename Context>
+	inline auto& ContextRegister(Context* ctx, std::uint8_t reg) noexcept
+	{
+		switch (reg)
+		{
+#if defined(HWBP_X64)
+		case 0:
+			return ctx->Rax;
+		case 1:
+			return ctx->Rcx;
+		case 2:
+			return ctx->Rdx;
+		case 3:
+			return ctx->Rbx;
+		case 4:
+			return ctx->Rsp;
+		case 5:
+			return ctx->Rbp;
+		case 6:
+			return ctx->Rsi;
+		case 7:
+			return ctx->Rdi;
+		case 8:
+			return ctx->R8;
+		case 9:
+			return ctx->R9;
+		case 10:
+			return ctx->R10;
+		case 11:
+			return ctx->R11;
+		case 12:
+			return ctx->R12;
+		case 13:
+			return ctx->R13;
+		case 14:
+			return ctx->R14;
+		default:
+			return ctx->R15;
+#else
+		case 0:
+			return ctx->Eax;
+		case 1:
+			return ctx->Ecx;
+		case 2:
+			return ctx->Edx;
+		case 3:
+			return ctx->Ebx;
+		case 4:
+			return ctx->Esp;
+		case 5:
+			return ctx->Ebp;
+		case 6:
+			return ctx->Esi;
+		default:
+			return ctx->Edi;
+#endif
+		}
+	}
+
+	//! EFLAGS after `a - b`, with CF, PF, AF, ZF, SF and OF set the way sub sets them
+	inline std::uintptr_t SubFlags(std::uintptr_t flags, std::uintptr_t a, std::uintptr_t b) noexcept
+	{
+		constexpr int Top = sizeof(std::uintptr_t) * 8 - 1;
+		const std::uintptr_t r = a - b;
+
+		flags &= ~static_cast<std::uintptr_t>(0x8d5);
+
+		if (a < b)
+			flags |= 0x1;
+		if ((std::popcount(r & 0xff) & 1) == 0)
+			flags |= 0x4;
+		if ((a ^ b ^ r) & 0x10)
+			flags |= 0x10;
+		if (r == 0)
+			flags |= 0x40;
+		if (r >> Top)
+			flags |= 0x80;
+		if (((a ^ b) & (a ^ r)) >> Top)
+			flags |= 0x800;
+
+		return flags;
+	}
+
+#if defined(HWBP_WINDOWS)
+	//! Whether a stack write at `slot` could land in the exception's own record
+	inline bool InExceptionFrame(const CONTEXT* ctx, std::uintptr_t slot) noexcept
+	{
+		//
+		// The dispatcher may keep the very context we are editing right below the
+		// interrupted stack pointer
+		return slot < (std::uintptr_t)(ctx + 1) && slot + sizeof(std::uintptr_t) > (std::uintptr_t)ctx;
+	}
+#else
+	//! Whether a stack write at `slot` could land in the signal frame
+	inline bool InExceptionFrame(const HwbpContext* ctx, std::uintptr_t slot) noexcept
+	{
+#if defined(HWBP_X64)
+		constexpr std::uintptr_t RedZone = 128;
+#else
+		constexpr std::uintptr_t RedZone = 0;
+#endif
+		//
+		// The kernel builds the frame (siginfo and ucontext, the fpu/xsave state above them)
+		// right below the interrupted stack pointer and its red zone. Anything from its lowest
+		// part up to there is off limits, which errs on the safe side for an alternate stack.
+		const ucontext_t* uc = ctx->Native();
+
+		std::uintptr_t low = (std::uintptr_t)uc;
+		if (uc->uc_mcontext.fpregs)
+			low = std::min(low, (std::uintptr_t)uc->uc_mcontext.fpregs);
+
+		low -= sizeof(siginfo_t) + 4 * sizeof(void*);
+
+		const auto high = static_cast<std::uintptr_t>(ContextRegister(ctx, 4)) - RedZone;
+		return slot + sizeof(std::uintptr_t) > low && slot < high;
+	}
+#endif
+
+	//
+	// Run `insn` (decoded at the context's instruction pointer) on `ctx` and step past it.
+	// Returns false, leaving the context untouched, if it has to execute for real.
+	//
+	template<typename Context>
+	bool EmulateInstruction(const EmulatedInstruction& insn, Context* ctx) noexcept
+	{
+		auto& sp = ContextRegister(ctx, 4);
+
+		switch (insn.m_op)
+		{
+		case EmulatedOp::Push:
+		{
+			const auto slot = static_cast<std::uintptr_t>(sp) - sizeof(std::uintptr_t);
+
+			if (InExceptionFrame(ctx, slot))
+				return false;
+
+			*(std::uintptr_t*)slot = static_cast<std::uintptr_t>(ContextRegister(ctx, insn.m_src));
+			sp = slot;
+			break;
+		}
+		case EmulatedOp::Mov:
+		{
+			auto value = static_cast<std::uintptr_t>(ContextRegister(ctx, insn.m_src));
+			if (insn.m_narrow)
+				value = static_cast<std::uint32_t>(value);
+
+			ContextRegister(ctx, insn.m_dst) = value;
+			break;
+		}
+		case EmulatedOp::SubSp:
+		{
+			const auto a = static_cast<std::uintptr_t>(sp);
+			const auto b = static_cast<std::uintptr_t>(static_cast<std::intptr_t>(insn.m_imm));
+
+			ctx->EFlags = static_cast<std::remove_reference_t<decltype(ctx->EFlags)>>(SubFlags(ctx->EFlags, a, b));
+			sp = a - b;
+			break;
+		}
+		default:
+			return false;
+		}
+
+#if defined(HWBP_X64)
+		ctx->Rip += insn.m_length;
+#else
+		ctx->Eip += insn.m_length;
+#endif
+		return true;
+	}
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//
+// Copy-on-write pointer set with epoch based reclamation.
+//
+// Readers (the exception handler, the thread creation hook) never take a lock, they only
+// bump a counter for the current epoch. Writers are serialized, publish a new snapshot and
+// then wait until every reader that could still observe the old one has left, so anything
+// removed from the set can be freed as soon as Remove() returns.
+//
+// Note: Insert/Remove/Synchronize must not be called from inside a read section on the same
+// thread (i.e. destroying a breakpoint from its own handler), it would wait on itself. Code
+// that may run either way checks InReadSection first.
+//
+// With HWBP_SINGLE_THREADED a single thread does all reading and writing, readers skip the
+// shared counters and writers never wait.
+//
+template<typename T>
+class EpochRegistry
+{
+	using Snapshot = std::vector<T*>;
+
+public:
+	class ReadGuard
+	{
+		EpochRegistry& m_registry;
+		std::uint32_t m_epoch;
+		const Snapshot* m_snapshot;
+
+	public:
+		explicit ReadGuard(EpochRegistry& registry) noexcept
+			: m_registry(registry)
+			, m_epoch(registry.Enter())
+			, m_snapshot(registry.m_snapshot.load(std::memory_order_acquire))
+		{
+			s_readDepth++;
+		}
+
+		ReadGuard(const ReadGuard&) = delete;
+
+		~ReadGuard() noexcept
+		{
+			s_readDepth--;
+			m_registry.Leave(m_epoch);
+		}
+
+		auto begin() const noexcept
+		{
+			return m_snapshot->begin();
+		}
+
+		auto end() const noexcept
+		{
+			return m_snapshot->end();
+		}
+	};
+
+	EpochRegistry() = default;
+	EpochRegistry(const EpochRegistry&) = delete;
+
+	~EpochRegistry()
+	{
+		delete m_snapshot.load(std::memory_order_relaxed);
+	}
+
+	void Insert(T* item)
+	{
+		std::lock_guard lock(m_writerLock);
+
+		const Snapshot* current = m_snapshot.load(std::memory_order_relaxed);
+		Snapshot* next = new Snapshot(*current);
+		next->push_back(item);
+
+		Publish(current, next);
+	}
+
+	bool Remove(T* item)
+	{
+		std::lock_guard lock(m_writerLock);
+
+		const Snapshot* current = m_snapshot.load(std::memory_order_relaxed);
+		Snapshot* next = new Snapshot{};
+		next->reserve(current->size());
+
+		for (T* p : *current)
+		{
+			if (p != item)
+				next->push_back(p);
+		}
+
+		if (next->size() == current->size())
+		{
+			delete next;
+			return false;
+		}
+
+		Publish(current, next);
+		return true;
+	}
+
+	//! Whether the calling thread holds a ReadGuard (of any registry of this type)
+	static bool InReadSection() noexcept
+	{
+		return s_readDepth != 0;
+	}
+
+	//! Wait until every reader that entered before this call has left
+	void Synchronize()
+	{
+		std::lock_guard lock(m_writerLock);
+		WaitForReaders();
+	}
+
+private:
+	std::uint32_t Enter() noexcept
+	{
+#if defined(HWBP_SINGLE_THREADED)
+		return 0;
+#else
+		//
+		// Only retries if a writer flipped the epoch between the load and the increment
+		for (;;)
+		{
+			const std::uint32_t epoch = m_epoch.load();
+			m_readers[epoch & 1].m_count.fetch_add(1);
+
+			if (m_epoch.load() == epoch)
+				return epoch;
+
+			m_readers[epoch & 1].m_count.fetch_sub(1, std::memory_order_release);
+		}
+#endif
+	}
+
+	void Leave(std::uint32_t epoch) noexcept
+	{
+#if !defined(HWBP_SINGLE_THREADED)
+		m_readers[epoch & 1].m_count.fetch_sub(1, std::memory_order_release);
+#endif
+	}
+
+	void Publish(const Snapshot* current, Snapshot* next)
+	{
+		m_snapshot.store(next);
+		WaitForReaders();
+		delete current;
+	}
+
+	void WaitForReaders() noexcept
+	{
+#if !defined(HWBP_SINGLE_THREADED)
+		//
+		// Readers arriving after the flip count against the other parity and can only see
+		// what has already been published. Writers are serialized, so the previous writer
+		// has drained this parity of anything older.
+		const std::uint32_t epoch = m_epoch.fetch_add(1);
+
+		while (m_readers[epoch & 1].m_count.load(std::memory_order_acquire) != 0)
+			std::this_thread::yield();
+#endif
+	}
+
+private:
+	struct alignas(64) ReaderCount
+	{
+		std::atomic<std::uint32_t> m_count{};
+	};
+
+	//! Current snapshot of the set
+	std::atomic<const Snapshot*> m_snapshot{ new Snapshot{} };
+	//! Epoch counter, parity selects the reader count
+	alignas(64) std::atomic<std::uint32_t> m_epoch{};
+	//! Active readers per epoch parity
+	ReaderCount m_readers[2]{};
+	//! Serializes writers
+	std::mutex m_writerLock;
+	//! ReadGuards the current thread holds
+	static inline thread_local std::uint32_t s_readDepth{};
+};
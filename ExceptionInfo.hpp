@@ -0,0 +1,106 @@
+#pragma once
+
+#if defined(HWBP_WINDOWS)
+
+//
+// Notify handlers receive the exception as the VEH saw it
+//
+using HwbpExceptionInfo = EXCEPTION_POINTERS;
+
+#else
+
+//
+// Register state of the thread that hit a breakpoint. Fields are named after the Windows
+// CONTEXT members so handlers can be shared between both backends, writes go straight
+// into the state the thread resumes with.
+//
+struct HwbpContext
+{
+	explicit HwbpContext(ucontext_t* uc) noexcept
+#if defined(HWBP_X64)
+		: Rax(uc->uc_mcontext.gregs[REG_RAX])
+		, Rcx(uc->uc_mcontext.gregs[REG_RCX])
+		, Rdx(uc->uc_mcontext.gregs[REG_RDX])
+		, Rbx(uc->uc_mcontext.gregs[REG_RBX])
+		, Rsp(uc->uc_mcontext.gregs[REG_RSP])
+		, Rbp(uc->uc_mcontext.gregs[REG_RBP])
+		, Rsi(uc->uc_mcontext.gregs[REG_RSI])
+		, Rdi(uc->uc_mcontext.gregs[REG_RDI])
+		, R8(uc->uc_mcontext.gregs[REG_R8])
+		, R9(uc->uc_mcontext.gregs[REG_R9])
+		, R10(uc->uc_mcontext.gregs[REG_R10])
+		, R11(uc->uc_mcontext.gregs[REG_R11])
+		, R12(uc->uc_mcontext.gregs[REG_R12])
+		, R13(uc->uc_mcontext.gregs[REG_R13])
+		, R14(uc->uc_mcontext.gregs[REG_R14])
+		, R15(uc->uc_mcontext.gregs[REG_R15])
+		, Rip(uc->uc_mcontext.gregs[REG_RIP])
+#else
+		: Eax(uc->uc_mcontext.gregs[REG_EAX])
+		, Ecx(uc->uc_mcontext.gregs[REG_ECX])
+		, Edx(uc->uc_mcontext.gregs[REG_EDX])
+		, Ebx(uc->uc_mcontext.gregs[REG_EBX])
+		, Esp(uc->uc_mcontext.gregs[REG_ESP])
+		, Ebp(uc->uc_mcontext.gregs[REG_EBP])
+		, Esi(uc->uc_mcontext.gregs[REG_ESI])
+		, Edi(uc->uc_mcontext.gregs[REG_EDI])
+		, Eip(uc->uc_mcontext.gregs[REG_EIP])
+#endif
+		, EFlags(uc->uc_mcontext.gregs[REG_EFL])
+		, m_uc(uc)
+	{
+	}
+
+	HwbpContext(const HwbpContext&) = delete;
+
+	//! The full signal context, for anything not mirrored above (fpu state, signal mask)
+	ucontext_t* Native() const noexcept
+	{
+		return m_uc;
+	}
+
+#if defined(HWBP_X64)
+	greg_t& Rax;
+	greg_t& Rcx;
+	greg_t& Rdx;
+	greg_t& Rbx;
+	greg_t& Rsp;
+	greg_t& Rbp;
+	greg_t& Rsi;
+	greg_t& Rdi;
+	greg_t& R8;
+	greg_t& R9;
+	greg_t& R10;
+	greg_t& R11;
+	greg_t& R12;
+	greg_t& R13;
+	greg_t& R14;
+	greg_t& R15;
+	greg_t& Rip;
+#else
+	greg_t& Eax;
+	greg_t& Ecx;
+	greg_t& Edx;
+	greg_t& Ebx;
+	greg_t& Esp;
+	greg_t& Ebp;
+	greg_t& Esi;
+	greg_t& Edi;
+	greg_t& Eip;
+#endif
+	greg_t& EFlags;
+
+private:
+	ucontext_t* m_uc;
+};
+
+//
+// Same shape as EXCEPTION_POINTERS, ExceptionRecord is the SIGTRAP siginfo
+//
+struct HwbpExceptionInfo
+{
+	siginfo_t*		ExceptionRecord;
+	HwbpContext*	ContextRecord;
+};
+
+#endif
@@ -1,7 +1,141 @@
 #include "HardwareBreakpoint.hpp"
+#include "HitQueue.hpp"
 
-static std::vector<HardwareBreakpoint*> s_hwbpList;
-static bool s_addedHandler{ false };
+#if defined(HWBP_WINDOWS)
+static EpochRegistry<HardwareBreakpoint> s_hwbpRegistry;
+static PVOID s_vehHandle{ nullptr };
+static bool s_hookedThreads{ false };
+static std::mutex s_hookLock;
+
+//
+// Debug registers every new thread starts with. Every commit publishes a new one before it
+// walks the threads and retires the old one, new threads read it without any lock.
+struct DebugRegisterImage
+{
+	decltype(CONTEXT::Dr0) m_dr[4]{};
+	decltype(CONTEXT::Dr7) m_dr7{};
+	HardwareBreakpoint* m_bp[4]{};
+	std::uint32_t m_bpGeneration[4]{};
+};
+
+static std::atomic<DebugRegisterImage*> s_threadImage{ new DebugRegisterImage{} };
+
+//
+// Breakpoint each debug register slot (Dr0-Dr3) of a thread holds, indexed by DR6 B0-B3.
+// Threads pick whichever slots are free in their own context, so the same breakpoint may
+// sit in different slots on different threads.
+struct HwbpThreadSlots
+{
+	DWORD m_threadId{};
+	//! Next table in the same bucket
+	std::atomic<HwbpThreadSlots*> m_next{};
+	std::atomic<HardwareBreakpoint*> m_bp[4]{};
+	//! HardwareBreakpoint::m_generation of each slot's breakpoint when the slot was written
+	std::atomic<std::uint32_t> m_bpGeneration[4]{};
+	//! Commit generation that last stamped the entry, see Commit
+	std::uint64_t m_generation{};
+	//! Set until the thread's registers were first written, by its own start or a commit
+	bool m_starting{};
+	//! Held while the thread's registers and slots are written
+	std::mutex m_lock;
+};
+
+//
+// Thread id -> slots, a fixed number of buckets each holding a list. Writers (holding the
+// lock) link new tables in at the head and unlink the tables of exited threads, retiring
+// them. The exception handler walks its bucket without taking any lock while its ReadGuard
+// keeps whatever it can reach alive. Adding a thread links one table, nothing is copied.
+static constexpr std::size_t HwbpSlotBuckets = 256;
+
+static std::atomic<HwbpThreadSlots*> s_threadSlots[HwbpSlotBuckets]{};
+static std::mutex s_threadSlotsLock;
+static std::uint64_t s_slotGeneration{};
+
+//
+// Serializes commits, they share the slot tables
+static std::mutex s_commitLock;
+
+//
+// Set when a runOnce breakpoint fired and left slots behind on other threads
+static std::atomic<bool> s_pendingDisarms{};
+
+void HwbpRetire(std::shared_ptr<void> object) noexcept;
+void HwbpReclaimRetired(EpochRegistry<HardwareBreakpoint>& registry) noexcept;
+
+static std::atomic<HwbpThreadSlots*>& HwbpSlotBucket(DWORD tid) noexcept
+{
+	//
+	// Thread ids are multiples of four
+	return s_threadSlots[(tid >> 2) % HwbpSlotBuckets];
+}
+
+//! Slot table of a thread, lock free (the caller holds a ReadGuard or s_threadSlotsLock)
+static HwbpThreadSlots* HwbpFindSlots(DWORD tid) noexcept
+{
+	for (HwbpThreadSlots* table = HwbpSlotBucket(tid).load(std::memory_order_acquire); table;
+		table = table->m_next.load(std::memory_order_acquire))
+	{
+		if (table->m_threadId == tid)
+			return table;
+	}
+
+	return nullptr;
+}
+
+//! Slot table of the current thread, lock free (the caller holds a ReadGuard)
+static HwbpThreadSlots* HwbpCurrentSlots() noexcept
+{
+	return HwbpFindSlots(GetCurrentThreadId());
+}
+
+//! Slot table of a thread, linked in on first use, call with s_threadSlotsLock held
+static HwbpThreadSlots& HwbpAddSlots(DWORD tid)
+{
+	if (HwbpThreadSlots* table = HwbpFindSlots(tid))
+		return *table;
+
+	auto* table = new HwbpThreadSlots();
+	table->m_threadId = tid;
+
+	std::atomic<HwbpThreadSlots*>& bucket = HwbpSlotBucket(tid);
+	table->m_next.store(bucket.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	bucket.store(table, std::memory_order_release);
+
+	return *table;
+}
+
+//! Slot table of a thread, created on first use and stamped with the current commit
+static HwbpThreadSlots& HwbpSlotsOf(DWORD tid, std::uint64_t generation)
+{
+	std::lock_guard lock(s_threadSlotsLock);
+
+	HwbpThreadSlots& table = HwbpAddSlots(tid);
+	table.m_generation = generation;
+	return table;
+}
+
+//! Unlink and retire the tables no walk stamped with `generation`, call with s_threadSlotsLock held
+static void HwbpEraseStaleSlots(std::uint64_t generation)
+{
+	for (std::atomic<HwbpThreadSlots*>& bucket : s_threadSlots)
+	{
+		std::atomic<HwbpThreadSlots*>* link = &bucket;
+
+		while (HwbpThreadSlots* table = link->load(std::memory_order_relaxed))
+		{
+			if (table->m_generation >= generation)
+			{
+				link = &table->m_next;
+				continue;
+			}
+
+			//
+			// A handler standing on it still reaches the rest of the bucket through m_next
+			link->store(table->m_next.load(std::memory_order_relaxed), std::memory_order_release);
+			HwbpRetire(std::shared_ptr<HwbpThreadSlots>(table));
+		}
+	}
+}
 
 static LONG WINAPI HwbpVectoredExceptionHandler(EXCEPTION_POINTERS* pException);
 
@@ -9,300 +143,422 @@ static LONG WINAPI HwbpVectoredExceptionHandler(EXCEPTION_POINTERS* pException);
 // We need to hook thread creations and modify them
 void(__fastcall* _HwbpBaseThreadInitThunk)(ULONG, LPTHREAD_START_ROUTINE, LPVOID);
 static void __fastcall HwbpBaseThreadInitThunk(ULONG ulState, LPTHREAD_START_ROUTINE lpStartAddress, LPVOID lpParam);
+static void HwbpHookThreadCreation();
+void HwbpRebuildThreadImage(const HardwareBreakpointBatch& batch);
 
 #if defined(HWBP_X64)
-static constexpr std::uint8_t _JmpOut[] = { 0x48, 0xB8, 0x0D, 0xD0, 0x0D, 0x60, 0x15, 0xEE, 0xFF, 0xC0, 0xFF, 0xE0 };
-static constexpr auto _JmpOutOffset = 0x2;
 #define SET_INSTRUCTION_PTR(i, p) i->ContextRecord->Rip = (std::uintptr_t)p
 #else
-static constexpr std::uint8_t _JmpOut[] = { 0x68, 0xEF, 0xBE, 0xAD, 0xDE, 0xC3 };
-static constexpr auto _JmpOutOffset = 0x1;
 #define SET_INSTRUCTION_PTR(i, p) i->ContextRecord->Eip = (std::uintptr_t)p
 #endif
 
-HardwareBreakpoint::HardwareBreakpoint(bool singleThread, bool runOnce)
-	: m_singleThread(singleThread)
+HardwareBreakpoint::HardwareBreakpoint(bool singleThread, bool runOnce, std::uint32_t threadId)
+	: m_singleThread(singleThread || HwbpDetail::SingleThreaded)
+	, m_threadId(threadId)
 	, m_runOnce(runOnce)
 {
-	if (!s_addedHandler)
 	{
+		std::lock_guard lock(s_hookLock);
+
 		//
 		// Add a VEH
-		AddVectoredExceptionHandler(0, HwbpVectoredExceptionHandler);
-		//
-		// Hook BaseThreadInitThunk
-		if (!HookExportDirect("kernel32", "BaseThreadInitThunk", HwbpBaseThreadInitThunk, (void**)&_HwbpBaseThreadInitThunk))
-			FormatError("[!] Error hooking BaseThreadInitThunk\n");
-
-		s_addedHandler = true;
+		if (!s_vehHandle)
+			s_vehHandle = AddVectoredExceptionHandler(0, HwbpVectoredExceptionHandler);
 	}
-	
 
-	s_hwbpList.push_back(this);
+	s_hwbpRegistry.Insert(this);
 }
 
 HardwareBreakpoint::~HardwareBreakpoint()
 {
 	Disable();
 
-	auto it = std::find(s_hwbpList.begin(), s_hwbpList.end(), this);
-
-	if (it != s_hwbpList.end())
-		s_hwbpList.erase(it);
+	//
+	// Once this returns no handler can still be looking at us
+	s_hwbpRegistry.Remove(this);
+	delete m_target.load(std::memory_order_relaxed);
 }
+#endif
 
 bool HardwareBreakpoint::Create(void* address, BreakpointLength size, BreakpointCondition cond, std::optional<BreakpointHandler> handler) noexcept
 {
-	if (m_regIdx != -1)
+	HardwareBreakpointBatch batch;
+
+	if (!batch.Create(*this, address, size, cond, handler))
 		return false;
 
-	m_address = (std::uintptr_t)address;
-	m_size = size;
-	m_cond = cond;
+	return batch.Commit();
+}
 
-	if (handler.has_value())
-	{
-		m_handler = handler.value();
-	
-		//
-		// Invalid handler mixture, reset it
-		if (m_handler.m_type == BreakpointHandlerType::Hook && cond != BreakpointCondition::Execute)
-		{
-			m_handler.m_type = BreakpointHandlerType::None;
-			FormatError("[!] Invalid BreakpointHandlerType (wanted hook in a R/RW breakpoint)\n");
-		}
-	}
+bool HardwareBreakpoint::Retarget(void* address, BreakpointLength size, BreakpointCondition cond) noexcept
+{
+	HardwareBreakpointBatch batch;
 
+	if (!batch.Retarget(*this, address, size, cond))
+		return false;
 
-	if (m_cond == BreakpointCondition::Execute)
-	{
-		//
-		// Force one byte length
-		m_size = BreakpointLength::OneByte;
+	return batch.Commit();
+}
 
-		//
-		// Calculate entire instruction len
-		hde_t hde{};
-		unsigned int inlen = hde_disasm(address, &hde);
-		
-		//
-		// If it is a jmp/call, let's go to the destination
-		switch (hde.opcode)
-		{
-		case 0xe8:
-		case 0xe9:
-			m_address += hde.imm.imm32 + inlen;
-			inlen = hde_disasm((void*)m_address, &hde);
-			break;
-		}
+void HardwareBreakpoint::Disable() noexcept
+{
+	HardwareBreakpointBatch batch;
 
-		//
-		// New jmp address
-		std::uintptr_t newOffset = m_address + inlen;
+	batch.Disable(*this);
+	batch.Commit();
+}
 
-		m_buffer.setup(inlen + sizeof(_JmpOut), PAGE_EXECUTE_READWRITE);
-		m_buffer.copy(0, (void*)m_address, inlen);
-		m_buffer.copy(inlen, &_JmpOut[0], sizeof(_JmpOut));
-		m_buffer.copy(inlen + _JmpOutOffset, &newOffset, sizeof(newOffset));
-	}
+#if defined(HWBP_WINDOWS)
+std::uint64_t HardwareBreakpoint::HitCount() const noexcept
+{
+	return m_hits.load(std::memory_order_relaxed);
+}
 
+std::size_t HardwareBreakpoint::DrainSamples(BreakpointSample* out, std::size_t count) noexcept
+{
+	if (!m_samples)
+		return 0;
 
-	//
-	// Setup a context for GetThreadContext
-	CONTEXT ctx{};
-	ctx.ContextFlags = CONTEXT_DEBUG_REGISTERS;
+	return m_samples->Drain(out, count);
+}
 
+//! Capture a sample from the faulting context
+static void HwbpRecordSample(SampleRing<BreakpointSample>& ring, const CONTEXT* ctx, std::atomic<std::uint64_t>& lost)
+{
+	BreakpointSample sample{};
+	sample.m_threadId = GetCurrentThreadId();
 
-	if (m_singleThread)
-	{
-		HANDLE hThisThread = GetCurrentThread();
-		
-		if (!GetThreadContext(hThisThread, &ctx))
-		{
-			FormatError("[!] Error calling GetThreadContext (err: {})\n", GetLastError());
-			return false;
-		}
+	auto reg = [&sample](SampleRegister r) -> std::uint64_t& { return sample.m_regs[static_cast<std::size_t>(r)]; };
 
-		if (!ModifyThreadContext(&ctx))
-		{
-			FormatError("[!] Error calling ModifyThreadContext\n");
-			return false;
-		}
+#if defined(HWBP_X64)
+	sample.m_ip = ctx->Rip;
+	reg(SampleRegister::Rax) = ctx->Rax;
+	reg(SampleRegister::Rbx) = ctx->Rbx;
+	reg(SampleRegister::Rcx) = ctx->Rcx;
+	reg(SampleRegister::Rdx) = ctx->Rdx;
+	reg(SampleRegister::Rsi) = ctx->Rsi;
+	reg(SampleRegister::Rdi) = ctx->Rdi;
+	reg(SampleRegister::Rbp) = ctx->Rbp;
+	reg(SampleRegister::Rsp) = ctx->Rsp;
+	reg(SampleRegister::R8) = ctx->R8;
+	reg(SampleRegister::R9) = ctx->R9;
+	reg(SampleRegister::R10) = ctx->R10;
+	reg(SampleRegister::R11) = ctx->R11;
+	reg(SampleRegister::R12) = ctx->R12;
+	reg(SampleRegister::R13) = ctx->R13;
+	reg(SampleRegister::R14) = ctx->R14;
+	reg(SampleRegister::R15) = ctx->R15;
+#else
+	sample.m_ip = ctx->Eip;
+	reg(SampleRegister::Rax) = ctx->Eax;
+	reg(SampleRegister::Rbx) = ctx->Ebx;
+	reg(SampleRegister::Rcx) = ctx->Ecx;
+	reg(SampleRegister::Rdx) = ctx->Edx;
+	reg(SampleRegister::Rsi) = ctx->Esi;
+	reg(SampleRegister::Rdi) = ctx->Edi;
+	reg(SampleRegister::Rbp) = ctx->Ebp;
+	reg(SampleRegister::Rsp) = ctx->Esp;
+#endif
+	reg(SampleRegister::Rip) = sample.m_ip;
+	reg(SampleRegister::EFlags) = ctx->EFlags;
 
-		//
-		// Set the new thread context
-		SetThreadContext(hThisThread, &ctx);
-	}
-	else
-	{
-		//
-		// Iterator over all threads in the process
-		ForEachThread(
-			[this, &ctx](HANDLE hThread)
-			{
-				if (!GetThreadContext(hThread, &ctx))
-				{
-					FormatError("[!] Error calling GetThreadContext (err: {})\n", GetLastError());
-					return;
-				}
-
-				if (!ModifyThreadContext(&ctx))
-				{
-					FormatError("[!] Error calling ModifyThreadContext\n");
-					return;
-				}
+	if (!ring.Push(sample))
+		lost.fetch_add(1, std::memory_order_relaxed);
+}
+#endif
 
-				//
-				// Set the new thread context
-				SetThreadContext(hThread, &ctx);
-			});
-	}
+//
+// Objects swapped out from under the handlers (targets, slot maps), a handler may still be
+// reading them
+static std::vector<std::shared_ptr<void>> s_retired;
+static std::mutex s_retiredLock;
+
+void HwbpRetire(std::shared_ptr<void> object) noexcept
+{
+	std::lock_guard lock(s_retiredLock);
+	s_retired.push_back(std::move(object));
 }
 
+void HardwareBreakpoint::Publish(std::unique_ptr<HwbpDetail::BreakpointTarget> target) noexcept
+{
+	HwbpRetire(std::shared_ptr<HwbpDetail::BreakpointTarget>(m_target.exchange(target.release(), std::memory_order_acq_rel)));
+}
 
-void HardwareBreakpoint::Disable() noexcept
+//
+// Free retired objects and hand freed instruction buffers back to the arena once every
+// handler that could still read them or send a thread into them has left. A handler can't
+// wait for itself, commits made from inside one leave the work to a later commit.
+//
+void HwbpReclaimRetired(EpochRegistry<HardwareBreakpoint>& registry) noexcept
 {
-	if (m_regIdx == -1)
+	if (EpochRegistry<HardwareBreakpoint>::InReadSection())
+		return;
+
+	auto& arena = TrampolineArena::Get();
+	std::vector<std::shared_ptr<void>> retired;
+
+	{
+		std::lock_guard lock(s_retiredLock);
+		retired.swap(s_retired);
+	}
+
+	if (retired.empty() && !arena.HasRetired())
 		return;
 
-	m_disabled = true;
+	const std::uint64_t mark = arena.RetireMark();
+
+	registry.Synchronize();
 
 	//
-	// Setup a context for GetThreadContext
-	CONTEXT ctx{};
-	ctx.ContextFlags = CONTEXT_DEBUG_REGISTERS;
+	// Buffers of retired targets are retired in turn and wait for the next grace period,
+	// which also covers a thread still running a stub its handler sent it into
+	retired.clear();
+	arena.Reclaim(mark);
+}
+
+bool HardwareBreakpoint::Prepare(void* address, BreakpointLength size, BreakpointCondition cond, HwbpDetail::BreakpointTarget& target) noexcept
+{
+	target.m_address = (std::uintptr_t)address;
+	target.m_size = size;
+	target.m_cond = cond;
+	target.m_resume = m_handler.m_resume;
 
 	//
-	// Clear out the debug registers
-	switch (m_regIdx)
+	// Invalid handler mixture, reset it
+	if (m_handler.m_type == BreakpointHandlerType::Hook && cond != BreakpointCondition::Execute)
 	{
-	case 0:
-		ctx.Dr0 = 0;
-		break;
-	case 1:
-		ctx.Dr1 = 0;
-		break;
-	case 2:
-		ctx.Dr2 = 0;
-		break;
-	case 3:
-		ctx.Dr3 = 0;
-		break;
+		m_handler.m_type = BreakpointHandlerType::None;
+		FormatError("[!] Invalid BreakpointHandlerType (wanted hook in a R/RW breakpoint)\n");
 	}
 
-	TBitSet<std::uintptr_t> dr7{ ctx.Dr7 };
-
+#if defined(HWBP_NO_HOOK)
+	if (m_handler.m_type == BreakpointHandlerType::Hook)
+	{
+		m_handler.m_type = BreakpointHandlerType::None;
+		FormatError("[!] Hook handlers are compiled out (HWBP_NO_HOOK)\n");
+	}
+#endif
+#if defined(HWBP_NO_SAMPLE)
+	if (m_handler.m_type == BreakpointHandlerType::Sample)
+	{
+		m_handler.m_type = BreakpointHandlerType::Count;
+		FormatError("[!] Sample handlers are compiled out (HWBP_NO_SAMPLE)\n");
+	}
+#endif
+#if defined(HWBP_NO_FILTER)
+	if (m_handler.m_filter)
+	{
+		m_handler.m_filter = {};
+		FormatError("[!] Filters are compiled out (HWBP_NO_FILTER)\n");
+	}
+#endif
+#if defined(HWBP_LINUX)
 	//
-	// Set this slot as disabled
-	dr7.SetBit(m_regIdx * 2, false);
+	// The kernel records samples without stopping the thread, nothing could filter them
+	if (m_handler.m_filter && m_handler.m_type == BreakpointHandlerType::Sample)
+	{
+		m_handler.m_filter = {};
+		FormatError("[!] Sample handlers can't be filtered on Linux\n");
+	}
+#endif
+
 	//
-	// Clear the condition type of the breakpoint (16-17, 21-20, 24-25, 28-29)
-	dr7.SetBits(16 + (m_regIdx * 2), 0);
+	// Resolved once here so the handlers call it without going through the variant
+	const BreakpointHandler::Notify_t* notify{};
+
+	if (m_handler.m_type == BreakpointHandlerType::Notify)
+	{
+		notify = std::get_if<BreakpointHandler::Notify_t>(&m_handler.m_var);
+		if (notify && !*notify)
+			notify = nullptr;
+	}
+
+	m_notify = notify;
+
+	if (m_handler.m_type == BreakpointHandlerType::Sample)
+	{
+		if (!std::holds_alternative<SampleOptions>(m_handler.m_var))
+			m_handler.m_var = SampleOptions{};
+
+		auto& options = std::get<SampleOptions>(m_handler.m_var);
+		options.m_period = std::max(options.m_period, 1u);
+		options.m_pages = std::bit_ceil(std::max(options.m_pages, 1u));
+
+#if defined(HWBP_WINDOWS)
+		if (!m_samples)
+			m_samples = std::make_unique<SampleRing<BreakpointSample>>(options.m_pages * 0x1000ull / sizeof(BreakpointSample));
+#endif
+	}
+
+	if (m_handler.m_type == BreakpointHandlerType::Async)
+	{
+		if (!std::holds_alternative<AsyncOptions>(m_handler.m_var))
+			m_handler.m_var = AsyncOptions{};
+
+		//
+		// The handlers only ever write into rings that already exist
+		if (!HitQueue::Get().Reserve())
+			return false;
+	}
+
 	//
-	// Clear the size of the breakpoint (18-19, 22-23, 26-27, 30-31)
-	dr7.SetBit(18 + (m_regIdx * 2), 0);
+	// The CPU ignores the low address bits below the length, a misaligned watch would
+	// silently cover other bytes
+	if (cond != BreakpointCondition::Execute && (target.m_address & (BreakpointBytes(size) - 1)) != 0)
+	{
+		FormatError("[!] {:#x} is not aligned to the {} byte breakpoint length\n", target.m_address, BreakpointBytes(size));
+		return false;
+	}
 
-	if (m_singleThread)
+	if (cond == BreakpointCondition::Execute)
 	{
-		HANDLE hThisThread = GetCurrentThread();
+		//
+		// Force one byte length
+		target.m_size = BreakpointLength::OneByte;
 
-		if (!GetThreadContext(hThisThread, &ctx))
+		//
+		// Calculate entire instruction len
+		hde_t hde{};
+		unsigned int inlen = hde_disasm(address, &hde);
+		
+		//
+		// If it is a jmp/call, let's go to the destination
+		switch (hde.opcode)
 		{
-			FormatError("[!] Error calling GetThreadContext (err: {})\n", GetLastError());
-			return;
+		case 0xe8:
+		case 0xe9:
+			target.m_address = HwbpDetail::BranchTarget((std::uint8_t*)target.m_address, hde);
+			inlen = hde_disasm((void*)target.m_address, &hde);
+			break;
 		}
 
-		ctx.Dr7 = static_cast<decltype(CONTEXT::Dr7)>(dr7.ToValue());
+		if (target.m_resume == BreakpointResume::Emulate)
+		{
+			target.m_emulated = HwbpDetail::DecodeEmulated(hde);
 
-		// Set the new thread context
-		if (!SetThreadContext(hThisThread, &ctx))
+			if (target.m_emulated.m_op == HwbpDetail::EmulatedOp::None)
+			{
+				FormatMsg("[+] Instruction at {:#x} isn't emulated, resuming with RF\n", target.m_address);
+				target.m_resume = BreakpointResume::ResumeFlag;
+			}
+		}
+
+		//
+		// Only the trampoline and hooks (calling the original through GetBuffer) run the copy.
+		// On Linux the kernel sets RF and a Trampoline resume runs the instruction in place.
+#if defined(HWBP_LINUX)
+		if (m_handler.m_type != BreakpointHandlerType::Hook)
+#else
+		if (target.m_resume != BreakpointResume::Trampoline && m_handler.m_type != BreakpointHandlerType::Hook)
+#endif
+			return true;
+
+		//
+		// Place the buffer near the instruction so the jump back is a rel32 whenever possible
+		target.m_buffer.setup(HwbpDetail::MaxRelocatedLength + TrampolineArena::MaxJumpLength, (void*)target.m_address);
+		if (!target.m_buffer.valid())
 		{
-			FormatError("[!] Error calling SetThreadContext (err: {})\n", GetLastError());
+			FormatError("[!] Error allocating instruction buffer (err: {})\n", HwbpLastError());
+			return false;
 		}
-	}
-	else
-	{
+
+		const auto pBuffer = (std::uintptr_t)target.m_buffer.buffer();
+		std::uint8_t stub[HwbpDetail::MaxRelocatedLength + TrampolineArena::MaxJumpLength]{};
+
 		//
-		// Iterator over all threads in the process
-		ForEachThread(
-			[this, &ctx, dr7](HANDLE hThread)
-			{
-				if (!GetThreadContext(hThread, &ctx))
-				{
-					FormatError("[!] Error calling GetThreadContext (err: {})\n", GetLastError());
-					return;
-				}
+		// Relative branches and RIP-relative operands have to be rewritten for their new home
+		const auto rellen = HwbpDetail::RelocateInstruction((std::uint8_t*)target.m_address, hde, stub, pBuffer);
+		if (rellen == 0)
+		{
+			FormatError("[!] Unable to relocate instruction at {:#x}\n", target.m_address);
+			return false;
+		}
 
-				ctx.Dr7 = static_cast<decltype(CONTEXT::Dr7)>(dr7.ToValue());
+		//
+		// Jump back to the instruction after the one we copied
+		const auto jmplen = TrampolineArena::EmitJump(&stub[rellen], pBuffer + rellen, target.m_address + inlen);
 
-				//
-				// Set the new thread context
-				if (!SetThreadContext(hThread, &ctx))
-				{
-					FormatError("[!] Error calling SetThreadContext (err: {})\n", GetLastError());
-				}
-			});
+		target.m_buffer.copy(stub, rellen + jmplen);
 	}
+
+	return true;
 }
 
-bool HardwareBreakpoint::ModifyThreadContext(CONTEXT* ctx) noexcept
+#if defined(HWBP_WINDOWS)
+bool HardwareBreakpoint::ModifyThreadContext(CONTEXT* ctx, HardwareBreakpoint** slots, const HwbpDetail::BreakpointTarget& target) noexcept
 {
 	TBitSet<std::uintptr_t> dr7 {ctx->Dr7};
 
 	//
-	// Try to find a free debug register
+	// Keep the slot we already hold in this thread, or take one that is free in it. A slot
+	// counts as taken if anything (us, a debugger, another component) enabled it.
+	int idx = -1;
 
-	if (m_regIdx == -1)
+	for (int i = 0; i < 4 && idx == -1; i++)
 	{
-		for (int i = 0; i < 4; i++)
+		if (slots[i] == this)
+			idx = i;
+	}
+
+	for (int i = 0; i < 4 && idx == -1; i++)
+	{
+		if (!slots[i] && !dr7.IsBitSet(i * 2) && !dr7.IsBitSet(i * 2 + 1))
 		{
-			if (!dr7.IsBitSet(i * 2))
-			{
-				FormatMsg("[+] Found free index at {}\n", i);
-				m_regIdx = i;
-				break;
-			}
+			FormatMsg("[+] Found free index at {}\n", i);
+			idx = i;
 		}
 	}
 
 	//
 	// They're all apparently taken.
-	if (m_regIdx == -1)
+	if (idx == -1)
 	{
 		FormatError("[!] No debug register\n");
 		return false;
 	}
 
+	slots[idx] = this;
+
+	ApplySlot(ctx, idx, target);
+	return true;
+}
+
+void HardwareBreakpoint::ApplySlot(CONTEXT* ctx, int idx, const HwbpDetail::BreakpointTarget& target) noexcept
+{
+	TBitSet<std::uintptr_t> dr7{ ctx->Dr7 };
+
 	//
 	// Set corresponding DR
-	switch (m_regIdx)
+	switch (idx)
 	{
 	case 0:
-		ctx->Dr0 = m_address;
+		ctx->Dr0 = target.m_address;
 		break;
 	case 1:
-		ctx->Dr1 = m_address;
+		ctx->Dr1 = target.m_address;
 		break;
 	case 2:
-		ctx->Dr2 = m_address;
+		ctx->Dr2 = target.m_address;
 		break;
 	case 3:
-		ctx->Dr3 = m_address;
+		ctx->Dr3 = target.m_address;
 		break;
 	}
 
 	//
-	// Note: Each mnemonic is 2 bits in length, so we advance as such
+	// Note: Each slot owns a 2 bit enable field and a 4 bit condition/size field
 
 	//
 	// Set this slot as enabled
-	dr7.SetBit(m_regIdx * 2, true);
+	dr7.SetBit(idx * 2, true);
 	//
-	// Set the condition type of the breakpoint (16-17, 21-20, 24-25, 28-29)
-	dr7.SetBits(16 + (m_regIdx * 2), (uint8_t)m_cond);
+	// Set the condition type of the breakpoint (16-17, 20-21, 24-25, 28-29)
+	dr7.SetBit(16 + (idx * 4), (std::uint8_t)target.m_cond & 1);
+	dr7.SetBit(17 + (idx * 4), (std::uint8_t)target.m_cond & 2);
 	//
 	// Set the size of the breakpoint (18-19, 22-23, 26-27, 30-31)
-	dr7.SetBit(18 + (m_regIdx * 2), (uint8_t)m_size);
+	dr7.SetBit(18 + (idx * 4), (std::uint8_t)target.m_size & 1);
+	dr7.SetBit(19 + (idx * 4), (std::uint8_t)target.m_size & 2);
 
 	//
 	// Debug print bits if wanted
@@ -311,130 +567,724 @@ bool HardwareBreakpoint::ModifyThreadContext(CONTEXT* ctx) noexcept
 	ctx->Dr7 = static_cast<decltype(CONTEXT::Dr7)>(dr7.ToValue());
 }
 
-LONG WINAPI HwbpVectoredExceptionHandler(EXCEPTION_POINTERS* pException)
+void HardwareBreakpoint::ClearThreadContext(CONTEXT* ctx, HardwareBreakpoint** slots) noexcept
 {
-	for (auto it = s_hwbpList.begin(); it != s_hwbpList.end(); it++)
-	{
-		HardwareBreakpoint* bp = *it;
-
-		if (bp->m_disabled)
-			continue;
-
-		if (bp->m_address == (std::uintptr_t)pException->ExceptionRecord->ExceptionAddress)
-		{
-			if (bp->m_handler.m_type != BreakpointHandlerType::None)
-			{
-				switch (bp->m_handler.m_type)
-				{
-				case BreakpointHandlerType::Hook:
-					SET_INSTRUCTION_PTR(pException, std::get<void*>(bp->m_handler.m_var));
-					break;
-				case BreakpointHandlerType::Notify:
-					std::get<BreakpointHandler::Notify_t>(bp->m_handler.m_var)(pException);
-					SET_INSTRUCTION_PTR(pException, bp->m_buffer.buffer());
-					break;
-				}
-			}
-			else
-			{
-				SET_INSTRUCTION_PTR(pException, bp->m_buffer.buffer());
-			}
-
-			if (bp->m_runOnce)
-			{
-				bp->Disable();
-			}
+	int idx = -1;
 
-			return EXCEPTION_CONTINUE_EXECUTION;
-		}
-		else if (pException->ExceptionRecord->ExceptionCode == EXCEPTION_SINGLE_STEP) // Catch single step
-		{
-			if (bp->m_handler.m_type == BreakpointHandlerType::Notify)
-			{
-				std::get<BreakpointHandler::Notify_t>(bp->m_handler.m_var)(pException);
-			}
+	for (int i = 0; i < 4 && idx == -1; i++)
+	{
+		if (slots[i] == this)
+			idx = i;
+	}
 
-			if (bp->m_runOnce)
-			{
-				bp->Disable();
-			}
+	if (idx == -1)
+		return;
 
-			return EXCEPTION_CONTINUE_EXECUTION;
-		}
-	}
+	slots[idx] = nullptr;
 
-	return EXCEPTION_CONTINUE_SEARCH;
+	ClearSlot(ctx, idx);
 }
 
-void __fastcall HwbpBaseThreadInitThunk(ULONG ulState, LPTHREAD_START_ROUTINE lpStartAddress, LPVOID lpParam)
+void HardwareBreakpoint::ClearSlot(CONTEXT* ctx, int idx) noexcept
 {
-	if (ulState == 0)
+	//
+	// Clear out the debug register
+	switch (idx)
 	{
-		for (auto it = s_hwbpList.begin(); it != s_hwbpList.end(); it++)
+	case 0:
+		ctx->Dr0 = 0;
+		break;
+	case 1:
+		ctx->Dr1 = 0;
+		break;
+	case 2:
+		ctx->Dr2 = 0;
+		break;
+	case 3:
+		ctx->Dr3 = 0;
+		break;
+	}
+
+	TBitSet<std::uintptr_t> dr7{ ctx->Dr7 };
+
+	//
+	// Set this slot as disabled
+	dr7.SetBit(idx * 2, false);
+	//
+	// Clear the condition type and size of the breakpoint
+	for (int i = 0; i < 4; i++)
+		dr7.SetBit(16 + (idx * 4) + i, false);
+
+	ctx->Dr7 = static_cast<decltype(CONTEXT::Dr7)>(dr7.ToValue());
+}
+#endif
+
+bool HardwareBreakpointBatch::Create(HardwareBreakpoint& bp, void* address, BreakpointLength size, BreakpointCondition cond, std::optional<BreakpointHandler> handler) noexcept
+{
+#if defined(HWBP_WINDOWS)
+	//
+	// A runOnce breakpoint that fired can be armed again, the commit reuses its old slots
+	if (bp.Armed() && !bp.m_pendingDisarm)
+#else
+	if (bp.Armed())
+#endif
+		return false;
+
+	if (handler.has_value())
+		bp.m_handler = handler.value();
+
+	auto target = std::make_unique<HwbpDetail::BreakpointTarget>();
+
+	if (!bp.Prepare(address, size, cond, *target))
+		return false;
+
+	m_entries.push_back({ &bp, Op::Arm, std::move(target) });
+	return true;
+}
+
+bool HardwareBreakpointBatch::Retarget(HardwareBreakpoint& bp, void* address, BreakpointLength size, BreakpointCondition cond) noexcept
+{
+	if (!bp.Armed())
+		return false;
+
+	//
+	// Built aside, the handlers keep dispatching with the current target (and threads keep
+	// running its buffer) until the commit has moved every thread
+	auto target = std::make_unique<HwbpDetail::BreakpointTarget>();
+
+	if (!bp.Prepare(address, size, cond, *target))
+		return false;
+
+	m_entries.push_back({ &bp, Op::Retarget, std::move(target) });
+	return true;
+}
+
+void HardwareBreakpointBatch::Disable(HardwareBreakpoint& bp) noexcept
+{
+	//
+	// A runOnce breakpoint that fired is disabled but may still hold slots (Linux: events)
+	if (!bp.Armed())
+		return;
+
+	m_entries.push_back({ &bp, Op::Disarm });
+}
+
+#if defined(HWBP_WINDOWS)
+bool HardwareBreakpointBatch::Commit() noexcept
+{
+	m_results.clear();
+
+	if (m_entries.empty())
+		return true;
+
+	//
+	// Publish every instruction buffer written while queueing
+	TrampolineArena::Get().Seal();
+
+	std::lock_guard commitLock(s_commitLock);
+
+	//
+	// runOnce breakpoints that fired since the last commit only cleared the slot of the
+	// thread they fired on, clear the rest along with this batch
+	if (s_pendingDisarms.exchange(false))
+	{
+		EpochRegistry<HardwareBreakpoint>::ReadGuard guard{ s_hwbpRegistry };
+
+		for (HardwareBreakpoint* bp : guard)
+		{
+			if (!bp->m_pendingDisarm.exchange(false))
+				continue;
+
+			if (std::none_of(m_entries.begin(), m_entries.end(), [bp](const Entry& entry) { return entry.m_bp == bp; }))
+				m_entries.insert(m_entries.begin(), { bp, Op::Disarm });
+		}
+	}
+
+	bool allThreads{ false };
+
+	for (Entry& entry : m_entries)
+	{
+		HardwareBreakpoint* bp = entry.m_bp;
+
+		//
+		// A disabled breakpoint is no longer dispatched to, even by stale slots
+		bp->m_disabled = entry.m_op == Op::Disarm;
+		bp->m_armed = entry.m_op != Op::Disarm;
+
+		//
+		// Nothing traps on a new breakpoint yet, its target can go live right away
+		if (entry.m_op == Op::Arm)
 		{
-			HardwareBreakpoint* bp = *it;
+			bp->m_generation.fetch_add(1, std::memory_order_relaxed);
+			bp->m_ownerThread = bp->m_threadId ? bp->m_threadId : GetCurrentThreadId();
+			bp->Publish(std::move(entry.m_target));
+		}
+
+		if (!bp->m_singleThread)
+			allThreads = true;
+	}
+
+	//
+	// A thread we couldn't write keeps its slots, but must not route them to breakpoints
+	// this batch disabled, those may be destroyed before it traps again
+	auto forget = [](HwbpThreadSlots& table)
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			HardwareBreakpoint* bp = table.m_bp[i].load(std::memory_order_relaxed);
+			if (bp && bp->m_disabled)
+				table.m_bp[i].store(nullptr, std::memory_order_release);
+		}
+	};
 
-			if (bp->m_disabled)
+	//
+	// Fold every queued change into the context, one read and one write per thread
+	std::uint64_t generation{};
+	{
+		std::lock_guard lock(s_threadSlotsLock);
+		generation = ++s_slotGeneration;
+	}
+
+	//
+	// Before the walk: a thread starting now is either listed for it or reads this image
+	HwbpRebuildThreadImage(*this);
+
+	auto apply = [this, generation, &forget](HANDLE hThread)
+	{
+		BatchThreadResult result{ GetThreadId(hThread), true, 0 };
+		HwbpThreadSlots& table = HwbpSlotsOf(result.m_threadId, generation);
+
+		//
+		// A thread still starting writes its image first
+		std::lock_guard tableLock(table.m_lock);
+
+		CONTEXT ctx{};
+		ctx.ContextFlags = CONTEXT_DEBUG_REGISTERS;
+
+		if (!GetThreadContext(hThread, &ctx))
+		{
+			result.m_success = false;
+			result.m_error = GetLastError();
+			FormatError("[!] Error calling GetThreadContext (err: {})\n", result.m_error);
+			forget(table);
+			m_results.push_back(result);
+			return;
+		}
+
+		//
+		// Work on a copy of the thread's slots, published around the context write
+		HardwareBreakpoint* old[4]{};
+		HardwareBreakpoint* slots[4]{};
+		std::uint32_t oldGeneration[4]{};
+
+		for (int i = 0; i < 4; i++)
+		{
+			old[i] = slots[i] = table.m_bp[i].load(std::memory_order_relaxed);
+			oldGeneration[i] = table.m_bpGeneration[i].load(std::memory_order_relaxed);
+		}
+
+		for (const Entry& entry : m_entries)
+		{
+			if (entry.m_bp->m_singleThread && entry.m_bp->m_ownerThread != result.m_threadId)
 				continue;
 
-			if (!bp->m_singleThread)
+			if (entry.m_op == Op::Disarm)
 			{
-				//
-				// Get the thread we're in
-				HANDLE hThisThread = GetCurrentThread();
+				entry.m_bp->ClearThreadContext(&ctx, slots);
+			}
+			else if (!entry.m_bp->ModifyThreadContext(&ctx, slots, entry.m_target ? *entry.m_target : entry.m_bp->Current()))
+			{
+				FormatError("[!] Error calling ModifyThreadContext\n");
+				result.m_success = false;
+			}
+		}
 
-				//
-				// Setup a context for GetThreadContext
-				CONTEXT ctx{};
-				ctx.ContextFlags = CONTEXT_DEBUG_REGISTERS;
+		//
+		// New slots must be routable before the thread can trap on them, cleared ones stay
+		// until it no longer can
+		for (int i = 0; i < 4; i++)
+		{
+			if (slots[i])
+			{
+				table.m_bpGeneration[i].store(slots[i]->m_generation, std::memory_order_relaxed);
+				table.m_bp[i].store(slots[i], std::memory_order_release);
+			}
+		}
+
+		//
+		// Set the new thread context
+		const bool written = SetThreadContext(hThread, &ctx);
+
+		for (int i = 0; i < 4; i++)
+		{
+			table.m_bp[i].store(written ? slots[i] : old[i], std::memory_order_release);
+
+			if (!written)
+				table.m_bpGeneration[i].store(oldGeneration[i], std::memory_order_relaxed);
+		}
+
+		if (!written)
+		{
+			result.m_success = false;
+			result.m_error = GetLastError();
+			FormatError("[!] Error calling SetThreadContext (err: {})\n", result.m_error);
+			forget(table);
+		}
+		else
+		{
+			table.m_starting = false;
+		}
+
+		m_results.push_back(result);
+	};
+
+	if (allThreads)
+	{
+		//
+		// New threads must pick up the breakpoints too, hook before walking the thread list
+		// so nothing started in between is missed
+		HwbpHookThreadCreation();
+
+		//
+		// Iterator over all threads in the process
+		HardwareBreakpoint::ForEachThread(apply);
+
+		//
+		// Every live thread was stamped by the walk (or by its start, if it began during it),
+		// anything older belongs to a thread that exited
+		std::lock_guard lock(s_threadSlotsLock);
+		HwbpEraseStaleSlots(generation);
+	}
+	else
+	{
+		//
+		// singleThread breakpoints live on the thread that armed them, which needn't be us
+		std::vector<DWORD> owners;
+
+		for (const Entry& entry : m_entries)
+		{
+			if (std::find(owners.begin(), owners.end(), entry.m_bp->m_ownerThread) == owners.end())
+				owners.push_back(entry.m_bp->m_ownerThread);
+		}
+
+		for (DWORD owner : owners)
+		{
+			if (owner == GetCurrentThreadId())
+			{
+				apply(GetCurrentThread());
+				continue;
+			}
+
+			ScopedHandle hThread{ OpenThread(THREAD_GET_CONTEXT | THREAD_SET_CONTEXT | THREAD_QUERY_LIMITED_INFORMATION, FALSE, owner) };
+			if (hThread.valid())
+			{
+				apply(hThread);
+				continue;
+			}
+
+			//
+			// The owner exited, only its table is left to clean up
+			std::lock_guard lock(s_threadSlotsLock);
+
+			if (HwbpThreadSlots* table = HwbpFindSlots(owner))
+				forget(*table);
+		}
+	}
+
+	const bool success = std::all_of(m_results.begin(), m_results.end(),
+		[](const BatchThreadResult& result) { return result.m_success; });
+
+	//
+	// Retargets go live once every thread traps on the new address, until then the handlers
+	// keep resuming with the old target. Threads a failed one left on the new address resume
+	// with RF (see Resume)
+	for (Entry& entry : m_entries)
+	{
+		if (entry.m_op == Op::Retarget && success)
+			entry.m_bp->Publish(std::move(entry.m_target));
+	}
 
-				if (!GetThreadContext(hThisThread, &ctx))
-				{
-					FormatError("[!] Error calling GetThreadContext (err: {})\n", GetLastError());
-					continue;
-				}
+	m_entries.clear();
 
+	HwbpReclaimRetired(s_hwbpRegistry);
+
+	return success;
+}
+
+LONG WINAPI HwbpVectoredExceptionHandler(EXCEPTION_POINTERS* pException)
+{
+	//
+	// Debug register hits are always raised as a single step, let anything else pass through untouched
+	if (pException->ExceptionRecord->ExceptionCode != EXCEPTION_SINGLE_STEP)
+		return EXCEPTION_CONTINUE_SEARCH;
+
+	CONTEXT* ctx = pException->ContextRecord;
+
+	//
+	// DR6 B0-B3 tell us which slots fired. The CPU may also set them for slots that
+	// matched without being enabled, only enabled ones count.
+	std::uint32_t fired = static_cast<std::uint32_t>(ctx->Dr6) & HwbpDetail::Dr6Slots;
+
+	for (int i = 0; i < 4; i++)
+	{
+		if ((ctx->Dr7 & (3ull << (i * 2))) == 0)
+			fired &= ~(1u << i);
+	}
+
+	if (fired == 0)
+		return EXCEPTION_CONTINUE_SEARCH;
+
+	EpochRegistry<HardwareBreakpoint>::ReadGuard guard{ s_hwbpRegistry };
+	HardwareBreakpoint* bps[4]{};
+	std::uint32_t generations[4]{};
+
+	//
+	// The slots that fired on this thread
+	if (HwbpThreadSlots* table = HwbpCurrentSlots())
+	{
+		for (std::uint32_t bits = fired; bits != 0; bits &= bits - 1)
+		{
+			const int idx = std::countr_zero(bits);
+			bps[idx] = table->m_bp[idx].load(std::memory_order_acquire);
+			generations[idx] = table->m_bpGeneration[idx].load(std::memory_order_relaxed);
+		}
+	}
+
+	//
+	// Several slots can fire on one instruction (two watches on the same access), each
+	// of ours is handled and its status bit cleared, the others are left for their owner
+	std::uint32_t ours{};
+
+	for (std::uint32_t bits = fired; bits != 0; bits &= bits - 1)
+	{
+		const int idx = std::countr_zero(bits);
+		HardwareBreakpoint* bp = bps[idx];
+
+		if (!bp)
+			continue;
+
+		ours |= 1u << idx;
+
+		//
+		// The status bits are sticky, clear them before resuming
+		ctx->Dr6 &= ~static_cast<decltype(CONTEXT::Dr6)>(1u << idx);
+
+		//
+		// Mid Retarget the slot may already hold the new target while we still dispatch with
+		// the old one, the slot's own R/W bits say how this hit has to be resumed
+		const HwbpDetail::BreakpointTarget& target = bp->Current();
+		const bool execute = ((ctx->Dr7 >> (16 + idx * 4)) & 3) == 0;
+
+		//
+		// Late hit on a slot the breakpoint no longer wants (a runOnce that already fired,
+		// or written for an earlier arm): drop it from this thread only, the next commit
+		// clears it everywhere else
+#if !defined(HWBP_NO_FILTER)
+		//
+		// Checked before a runOnce breakpoint claims the hit, a rejected one is just resumed
+		if (bp->m_handler.m_filter && !bp->m_disabled.load() &&
+			generations[idx] == bp->m_generation.load(std::memory_order_relaxed) &&
+			!bp->m_handler.m_filter.Evaluate(ctx))
+		{
+			if (execute)
+				HardwareBreakpoint::Resume(ctx, target);
+			continue;
+		}
+#endif
+
+#if !defined(HWBP_NO_RUNONCE)
+		const bool disabled = bp->m_runOnce ? bp->m_disabled.exchange(true) : bp->m_disabled.load();
+#else
+		const bool disabled = bp->m_disabled.load();
+#endif
+
+		if (disabled || generations[idx] != bp->m_generation.load(std::memory_order_relaxed))
+		{
+			HardwareBreakpoint::ClearSlot(ctx, idx);
+			continue;
+		}
+
+		[[maybe_unused]] const auto hits = bp->m_hits.fetch_add(1, std::memory_order_relaxed) + 1;
+
+#if !defined(HWBP_NO_SAMPLE)
+		if (bp->m_handler.m_type == BreakpointHandlerType::Sample && bp->m_samples &&
+			hits % std::get<SampleOptions>(bp->m_handler.m_var).m_period == 0)
+		{
+			HwbpRecordSample(*bp->m_samples, ctx, bp->m_lost);
+		}
+#endif
+
+		if (bp->m_handler.m_type == BreakpointHandlerType::Async)
+			HitQueue::Get().Record(bp->m_id, ctx, std::get<AsyncOptions>(bp->m_handler.m_var).m_registers);
+
+		if (execute)
+		{
+			switch (bp->m_handler.m_type)
+			{
+#if !defined(HWBP_NO_HOOK)
+			case BreakpointHandlerType::Hook:
+				SET_INSTRUCTION_PTR(pException, std::get<void*>(bp->m_handler.m_var));
+				break;
+#endif
+			case BreakpointHandlerType::Notify:
+				if (bp->m_notify)
+					(*bp->m_notify)(pException);
+				HardwareBreakpoint::Resume(ctx, target);
+				break;
+			default:
+				HardwareBreakpoint::Resume(ctx, target);
+				break;
+			}
+		}
+		else if (bp->m_notify) // Data breakpoints trap after the access
+		{
+			(*bp->m_notify)(pException);
+		}
+
+#if !defined(HWBP_NO_RUNONCE)
+		if (bp->m_runOnce)
+		{
+			//
+			// Disarm without leaving the exception: the context we resume with loses the
+			// slot, other threads drop theirs on a late hit or with the next commit
+			HardwareBreakpoint::ClearSlot(ctx, idx);
+
+			if (bp->m_singleThread)
+			{
 				//
-				// Try finding and setting debug registers
-				if (!bp->ModifyThreadContext(&ctx))
-				{
-					FormatError("[!] Error calling ModifyThreadContext (err: {})\n", GetLastError());
-					continue;
-				}
-
-				// Set the new thread context
-				if (!SetThreadContext(hThisThread, &ctx))
-				{
-					FormatError("[!] Error calling SetThreadContext (err: {})\n", GetLastError());
-				}
+				// No other thread ever held it
+				if (HwbpThreadSlots* table = HwbpCurrentSlots())
+					table->m_bp[idx].store(nullptr, std::memory_order_release);
+
+				bp->m_armed = false;
 			}
-		} 
+			else
+			{
+				bp->m_pendingDisarm = true;
+				s_pendingDisarms = true;
+			}
+		}
+#endif
+	}
+
+	if (ours == 0)
+		return EXCEPTION_CONTINUE_SEARCH;
+
+	//
+	// Still a single step trap (DR6.BS) or another owner's slot: the exception isn't only
+	// ours, let whoever set TF or armed that slot see it. A step PageWatch asked for has
+	// cleared BS already.
+	if ((ctx->Dr6 & HwbpDetail::Dr6SingleStep) || (fired & ~ours) != 0)
+		return EXCEPTION_CONTINUE_SEARCH;
+
+	return EXCEPTION_CONTINUE_EXECUTION;
+}
+
+void HardwareBreakpoint::Resume(CONTEXT* ctx, const HwbpDetail::BreakpointTarget& target) noexcept
+{
+#if defined(HWBP_X64)
+	auto& ip = ctx->Rip;
+#else
+	auto& ip = ctx->Eip;
+#endif
+
+	//
+	// Emulating or skipping to the copy is only right on the instruction the target was built
+	// for, anywhere else (the handler moved the thread, or a slot already retargeted) RF is
+	switch (ip == target.m_address ? target.m_resume : BreakpointResume::ResumeFlag)
+	{
+	case BreakpointResume::Emulate:
+		if (HwbpDetail::EmulateInstruction(target.m_emulated, ctx))
+			break;
+		[[fallthrough]];
+	case BreakpointResume::ResumeFlag:
+		//
+		// RF keeps the instruction breakpoint from firing again on the way back in
+		ctx->EFlags |= 0x10000;
+		break;
+	default:
+		if (!target.m_buffer.valid())
+		{
+			ctx->EFlags |= 0x10000;
+			break;
+		}
+
+		ip = (std::uintptr_t)target.m_buffer.buffer();
+		break;
+	}
+}
+
+void __fastcall HwbpBaseThreadInitThunk(ULONG ulState, LPTHREAD_START_ROUTINE lpStartAddress, LPVOID lpParam)
+{
+	if (ulState == 0)
+	{
+		HwbpThreadSlots* table{};
+
+		{
+			//
+			// Linked in before the thread is listed, so a commit walking it finds this table.
+			// A table left behind by an earlier thread with the same id is taken over. The
+			// stamp keeps a commit that didn't list us from dropping it as stale.
+			std::lock_guard lock(s_threadSlotsLock);
+
+			table = &HwbpAddSlots(GetCurrentThreadId());
+			table->m_generation = s_slotGeneration + 1;
+			table->m_starting = true;
+
+			for (auto& bp : table->m_bp)
+				bp.store(nullptr, std::memory_order_relaxed);
+		}
+
+		//
+		// Track the thread so ForEachThread never needs a system snapshot
+		ThreadRegistry::Get().OnThreadStart();
+
+		std::lock_guard tableLock(table->m_lock);
+
+		//
+		// A commit that listed us and got here first wrote everything already, one that
+		// still has to waits for us. One that walked before we were listed published its
+		// image before that, so we read it (or a later one) below.
+		if (table->m_starting)
+		{
+			EpochRegistry<HardwareBreakpoint>::ReadGuard guard{ s_hwbpRegistry };
+			const DebugRegisterImage& image = *s_threadImage.load(std::memory_order_acquire);
+
+			//
+			// New threads start with clear debug registers, so the precomputed image can be
+			// written as is without reading the context first
+			CONTEXT ctx{};
+			ctx.ContextFlags = CONTEXT_DEBUG_REGISTERS;
+			ctx.Dr0 = image.m_dr[0];
+			ctx.Dr1 = image.m_dr[1];
+			ctx.Dr2 = image.m_dr[2];
+			ctx.Dr3 = image.m_dr[3];
+			ctx.Dr7 = image.m_dr7;
+
+			//
+			// Route the image's slots before they can fire, replacing whatever a previous
+			// thread with the same id left behind
+			for (int i = 0; i < 4; i++)
+			{
+				table->m_bpGeneration[i].store(image.m_bpGeneration[i], std::memory_order_relaxed);
+				table->m_bp[i].store(image.m_bp[i], std::memory_order_release);
+			}
+
+			if (ctx.Dr7 != 0 && !SetThreadContext(GetCurrentThread(), &ctx))
+			{
+				FormatError("[!] Error calling SetThreadContext (err: {})\n", GetLastError());
+			}
+
+			table->m_starting = false;
+		}
 	}
 
 	return _HwbpBaseThreadInitThunk(ulState, lpStartAddress, lpParam);
 }
 
-void HwbpTerminate()
+static void HwbpHookThreadCreation()
 {
-	if (!s_addedHandler)
+	std::lock_guard lock(s_hookLock);
+
+	if (s_hookedThreads)
+		return;
+
+	//
+	// Hook BaseThreadInitThunk
+	if (!HookExportDirect("kernel32", "BaseThreadInitThunk", HwbpBaseThreadInitThunk, (void**)&_HwbpBaseThreadInitThunk))
+	{
+		FormatError("[!] Error hooking BaseThreadInitThunk\n");
 		return;
+	}
+
+	s_hookedThreads = true;
 
 	//
-	// Unhook kernel32!BaseThreadInitThunk
-	UnHookExportDirect("kernel32", "BaseThreadInitThunk");
+	// After an HwbpTerminate, threads created while unhooked are missing from the registry
+	ThreadRegistry::Get().Reseed();
+}
+
+//
+// Called with s_commitLock held, by the commit that changes the breakpoint set. Breakpoints
+// `batch` retargets go in with their new target, which every thread gets along with it.
+void HwbpRebuildThreadImage(const HardwareBreakpointBatch& batch)
+{
+	CONTEXT ctx{};
+	HardwareBreakpoint* slots[4]{};
+	std::uint32_t generations[4]{};
+	int next = 0;
+
+	{
+		EpochRegistry<HardwareBreakpoint>::ReadGuard guard{ s_hwbpRegistry };
+
+		//
+		// New threads have every slot free, pack the breakpoints from slot 0 on
+		for (HardwareBreakpoint* bp : guard)
+		{
+			if (bp->m_disabled || bp->m_singleThread || !bp->m_armed)
+				continue;
+
+			if (next == 4)
+			{
+				FormatError("[!] More breakpoints than debug registers, new threads only get four\n");
+				break;
+			}
+
+			auto it = std::find_if(batch.m_entries.begin(), batch.m_entries.end(),
+				[bp](const HardwareBreakpointBatch::Entry& entry) { return entry.m_bp == bp && entry.m_target; });
+
+			HardwareBreakpoint::ApplySlot(&ctx, next, it != batch.m_entries.end() ? *it->m_target : bp->Current());
+			generations[next] = bp->m_generation;
+			slots[next++] = bp;
+		}
+	}
+
+	auto image = std::make_unique<DebugRegisterImage>();
+	image->m_dr[0] = ctx.Dr0;
+	image->m_dr[1] = ctx.Dr1;
+	image->m_dr[2] = ctx.Dr2;
+	image->m_dr[3] = ctx.Dr3;
+	image->m_dr7 = ctx.Dr7;
+
+	for (int i = 0; i < 4; i++)
+	{
+		image->m_bp[i] = slots[i];
+		image->m_bpGeneration[i] = generations[i];
+	}
 
 	//
-	// Free hook trampoline
-	VirtualFree(_HwbpBaseThreadInitThunk, 0, MEM_RELEASE);
+	// A starting thread may still be reading the old one
+	HwbpRetire(std::shared_ptr<DebugRegisterImage>(s_threadImage.exchange(image.release(), std::memory_order_acq_rel)));
+}
+
+void HwbpTerminate()
+{
+	if (!s_vehHandle)
+		return;
+
+	if (s_hookedThreads)
+	{
+		//
+		// Unhook kernel32!BaseThreadInitThunk, this also frees the hook trampoline
+		UnHookExportDirect("kernel32", "BaseThreadInitThunk");
+
+		s_hookedThreads = false;
+	}
 
 	//
 	// Disable any hardware breakpoints that may still exist
-	for (auto bp : s_hwbpList)
 	{
-		bp->Disable();
+		EpochRegistry<HardwareBreakpoint>::ReadGuard guard{ s_hwbpRegistry };
+
+		for (HardwareBreakpoint* bp : guard)
+		{
+			bp->Disable();
+		}
 	}
 
 	//
 	// Lastly, remove the VEH
-	RemoveVectoredExceptionHandler(HwbpVectoredExceptionHandler);
+	RemoveVectoredExceptionHandler(s_vehHandle);
+	s_vehHandle = nullptr;
 }
+#endif
\ No newline at end of file
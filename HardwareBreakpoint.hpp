@@ -1,30 +1,90 @@
 #pragma once
 
+#if defined(_WIN32)
+	#define HWBP_WINDOWS
+#elif defined(__linux__)
+	#define HWBP_LINUX
+#else
+	#error "HardwareBreakpoint supports Windows and Linux only"
+#endif
+
+#if defined(HWBP_WINDOWS)
 #include <Windows.h>
 #include <TlHelp32.h>
-#include <iostream>
+#else
+#include <signal.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/perf_event.h>
+#include <linux/hw_breakpoint.h>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#endif
 #include <string_view>
 #include <vector>
-#include <functional>
 #include <optional>
 #include <variant>
+#include <bit>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
 
 #if defined(_DEBUG)
 	#define HWBP_DEBUG
 #endif
 
-#if defined(_WIN64)
+//
+// Build options. They change the library sources, so define them when compiling those
+// (e.g. -DHWBP_NO_HOOK) and use the same set for every translation unit including this
+// header; defining one in front of an #include in application code does nothing.
+//	HWBP_NO_HOOK		- Hook handlers fall back to None
+//	HWBP_NO_SAMPLE		- Sample handlers fall back to Count
+//	HWBP_NO_RUNONCE		- the runOnce argument is ignored
+//	HWBP_NO_FILTER		- BreakpointHandler::m_filter is ignored
+//	HWBP_SINGLE_THREADED	- the host calls the library from one thread only: every breakpoint is
+//				  singleThread, the registry skips its reader counts and
+//				  HardwareBreakpointScheduler has no Start
+//	HWBP_LOG_SINK		- receives diagnostics in any build, see Debug.hpp
+// Release builds (no HWBP_DEBUG) without a sink don't pull <format> or <iostream> in.
+//
+
+#if defined(_WIN64) || defined(__x86_64__)
 	#define HWBP_X64
-#else
+#elif defined(_M_IX86) || defined(__i386__)
 	#define HWBP_X86
+#else
+	#error "HardwareBreakpoint supports x86 and x64 only"
+#endif
+
+#if !defined(_MSC_VER) && !defined(__forceinline)
+	#define __forceinline inline __attribute__((always_inline))
 #endif
 
 #include "BitSet.hpp"
-#include "ScopedHandle.hpp"
+#include "TrampolineArena.hpp"
 #include "ScopedMemory.hpp"
 #include "Debug.hpp"
 #include "hde.hpp"
+#include "Relocate.hpp"
+#include "ExceptionInfo.hpp"
+#include "Emulate.hpp"
+#include "BreakpointFilter.hpp"
+#include "EpochRegistry.hpp"
+#include "SampleRing.hpp"
+#include "Delegate.hpp"
+
+#if defined(HWBP_WINDOWS)
+#include "ScopedHandle.hpp"
 #include "EATHook.hpp"
+#include "ThreadRegistry.hpp"
+#endif
 
 enum class BreakpointCondition : std::uint8_t
 {
@@ -42,98 +102,415 @@ enum class BreakpointLength : std::uint8_t
 	EightByte	= 0b10  // Address in corresponding DR must be qword aligned
 };
 
+//! Bytes covered by a BreakpointLength
+constexpr std::size_t BreakpointBytes(BreakpointLength size) noexcept
+{
+	switch (size)
+	{
+	case BreakpointLength::TwoByte:
+		return 2;
+	case BreakpointLength::FourByte:
+		return 4;
+	case BreakpointLength::EightByte:
+		return 8;
+	default:
+		return 1;
+	}
+}
+
+namespace HwbpDetail
+{
+	//! DR6 B0-B3, the debug register slots whose condition matched
+	static constexpr std::uint32_t Dr6Slots = 0xf;
+	//! DR6.BS, the exception is (also) an EFLAGS.TF single step trap
+	static constexpr std::uint32_t Dr6SingleStep = 0x4000;
+
+#if defined(HWBP_SINGLE_THREADED)
+	static constexpr bool SingleThreaded = true;
+#else
+	static constexpr bool SingleThreaded = false;
+#endif
+
+	//
+	// Whether a single step exception includes a TF trap. Windows may leave DR6 empty in
+	// threads without debug registers in use, and then nothing but TF could have raised it.
+	//
+	inline bool IsStepTrap(std::uintptr_t dr6) noexcept
+	{
+		return (dr6 & Dr6SingleStep) != 0 || (dr6 & Dr6Slots) == 0;
+	}
+}
+
 enum class BreakpointHandlerType : std::uint8_t
 {
 	None = 0,
 	Hook,
-	Notify		
+	Notify,
+	Count,		// Only count hits, read them with HardwareBreakpoint::HitCount
+	Sample,		// Record hits without running any handler, drain them with HardwareBreakpoint::DrainSamples
+	Async		// Queue a BreakpointHit per hit, consumed on another thread through HitQueue
+};
+
+//
+// How an execute breakpoint gets past the instruction it stopped on
+enum class BreakpointResume : std::uint8_t
+{
+	Trampoline,	// Run a relocated copy of the instruction from GetBuffer(), then jump back
+	ResumeFlag,	// Set EFLAGS.RF and run it in place, nothing is allocated
+	Emulate		// Run push reg/mov reg, reg/sub rsp, imm on the context, ResumeFlag for anything else
+};
+
+//
+// Registers captured with each sample (indices into BreakpointSample::m_regs)
+enum class SampleRegister : std::uint8_t
+{
+	Rax, Rbx, Rcx, Rdx, Rsi, Rdi, Rbp, Rsp, Rip, EFlags,
+	R8, R9, R10, R11, R12, R13, R14, R15, // Zero on x86
+
+	Count
+};
+
+struct BreakpointSample
+{
+	//! Instruction pointer when the hit was reported (after the access for data breakpoints)
+	std::uint64_t	m_ip{};
+	//! Thread that hit the breakpoint
+	std::uint32_t	m_threadId{};
+	//! General purpose registers, see SampleRegister
+	std::uint64_t	m_regs[static_cast<std::size_t>(SampleRegister::Count)]{};
+};
+
+//
+// Compact record of one Async hit, see HitQueue
+struct BreakpointHit
+{
+	//! std::chrono::steady_clock ticks when the hit was queued
+	std::uint64_t	m_timestamp{};
+	//! Instruction pointer when the hit was reported (after the access for data breakpoints)
+	std::uint64_t	m_ip{};
+	//! Registers picked by AsyncOptions::m_registers, lowest SampleRegister first
+	std::uint64_t	m_regs[4]{};
+	std::uint32_t	m_threadId{};
+	//! HardwareBreakpoint::Id of the breakpoint that was hit
+	std::uint32_t	m_breakpointId{};
+};
+
+struct SampleOptions
+{
+	//! Record every Nth hit
+	std::uint32_t	m_period{ 1 };
+	//! Ring size in 4 KB pages (per thread on Linux), rounded up to a power of two
+	std::uint32_t	m_pages{ 16 };
+};
+
+struct AsyncOptions
+{
+	//! Registers to capture, bit (1 << SampleRegister), the first four set are kept
+	std::uint32_t	m_registers{};
 };
 
 struct BreakpointHandler
 {
-	using Notify_t = std::function<void(EXCEPTION_POINTERS*)>;
+	using Notify_t = TDelegate<void(HwbpExceptionInfo*)>;
 	using Hook_t = void*;
+	using Sample_t = SampleOptions;
+	using Async_t = AsyncOptions;
 	 
 	BreakpointHandler() = default;
 	~BreakpointHandler() = default; 
 
 	BreakpointHandlerType m_type = BreakpointHandlerType::None;
-	std::variant<Notify_t, Hook_t> m_var;
+	//! Execute breakpoints only, Hook handlers never resume
+	BreakpointResume m_resume = BreakpointResume::Trampoline;
+	//! Hits that don't meet it resume without being counted or handled (empty: every hit)
+	BreakpointFilter m_filter;
+	std::variant<Notify_t, Hook_t, Sample_t, Async_t> m_var;
+};
+
+namespace HwbpDetail
+{
+	//
+	// Where a breakpoint sits and how an execute hit gets past its instruction. Commits build
+	// a new one aside and swap it in whole, so a handler never sees half of a Retarget.
+	//
+	struct BreakpointTarget
+	{
+		std::uintptr_t		m_address{};
+		BreakpointLength	m_size{};
+		BreakpointCondition m_cond{};
+		//! BreakpointHandler::m_resume, or the fallback Prepare settled on
+		BreakpointResume	m_resume{};
+		//! Instruction an Emulate resume runs on the context
+		EmulatedInstruction m_emulated{};
+		//! Relocated copy of the instruction (Hook handlers and Trampoline resumes)
+		ScopedMemory		m_buffer{};
+	};
+
+#if defined(HWBP_LINUX)
+	//
+	// The perf events one arm opened. Commits take a set off the breakpoint whole and close it
+	// only once no signal handler can still be stopping it.
+	//
+	struct EventSet
+	{
+		//! perf_event descriptors, one per thread present when armed
+		std::vector<int>	m_fds;
+		//! Sample ring mapped for each event (Sample handlers only)
+		std::vector<void*>	m_rings;
+		//! Size of each mapping in m_rings
+		std::size_t			m_ringSize{};
+
+		EventSet() = default;
+		EventSet(const EventSet&) = delete;
+
+		~EventSet()
+		{
+			for (void* ring : m_rings)
+				munmap(ring, m_ringSize);
+
+			for (int fd : m_fds)
+				close(fd);
+		}
+	};
+#endif
+}
+
+struct BatchThreadResult
+{
+	//! Thread the batch was applied to
+	std::uint32_t	m_threadId{};
+	//! Whether every queued change made it into the thread context
+	bool			m_success{};
+	//! Last error reported by Get/SetThreadContext or perf_event_open (0 if none)
+	std::uint32_t	m_error{};
 };
 
+class HardwareBreakpointBatch;
+
 class HardwareBreakpoint
 {
+	friend class HardwareBreakpointBatch;
+#if defined(HWBP_WINDOWS)
 	friend LONG WINAPI HwbpVectoredExceptionHandler(EXCEPTION_POINTERS* pException);
 	friend void __fastcall HwbpBaseThreadInitThunk(ULONG ulState, LPTHREAD_START_ROUTINE lpStartAddress, LPVOID lpParam);
+	friend void HwbpRebuildThreadImage(const HardwareBreakpointBatch& batch);
+#else
+	friend void HwbpSignalHandler(int sig, siginfo_t* info, void* uctx);
+#endif
 
 public:
 	//! No default or copy constructor
 	HardwareBreakpoint(const HardwareBreakpoint&) = delete;
-	HardwareBreakpoint(bool singleThread = false, bool runOnce = false);
+	//! `threadId` pins a singleThread breakpoint to that thread (0: the thread calling Create)
+	HardwareBreakpoint(bool singleThread = false, bool runOnce = false, std::uint32_t threadId = 0);
 	~HardwareBreakpoint();
 
 	//! Instantiate a Hardware Breakpoint
 	bool Create(void* address, BreakpointLength size, BreakpointCondition cond, std::optional<BreakpointHandler> handler = std::nullopt) noexcept;
 
+	//! Instantiate a Hardware Breakpoint notifying `Handler`, bound at compile time
+	template<auto Handler>
+	bool Create(void* address, BreakpointLength size, BreakpointCondition cond) noexcept
+	{
+		BreakpointHandler handler{};
+		handler.m_type = BreakpointHandlerType::Notify;
+		handler.m_var = BreakpointHandler::Notify_t::Bind<Handler>();
+
+		return Create(address, size, cond, handler);
+	}
+
+	//! Move an armed breakpoint, keeping its debug register (or perf events)
+	bool Retarget(void* address, BreakpointLength size, BreakpointCondition cond) noexcept;
+
 	//! Disable this hardware breakpoint
 	void Disable() noexcept;
 
 	//! Get buffer pointer
 	void* GetBuffer() const noexcept
 	{
-		return m_buffer.buffer();
+		return Current().m_buffer.buffer();
+	}
+
+	//! Times the breakpoint was hit since it was created
+	std::uint64_t HitCount() const noexcept;
+
+	//! Move up to `count` recorded samples into `out` (Sample handlers), returns how many
+	std::size_t DrainSamples(BreakpointSample* out, std::size_t count) noexcept;
+
+	//! Samples dropped because the ring was full
+	std::uint64_t LostSamples() const noexcept
+	{
+		return m_lost.load(std::memory_order_relaxed);
+	}
+
+	//! Process unique id, what BreakpointHit::m_breakpointId refers to
+	std::uint32_t Id() const noexcept
+	{
+		return m_id;
 	}
 
 private:
-	bool ModifyThreadContext(CONTEXT* ctx) noexcept;
+	//! Build the target and its instruction buffer into `target`, without touching any thread
+	bool Prepare(void* address, BreakpointLength size, BreakpointCondition cond, HwbpDetail::BreakpointTarget& target) noexcept;
+
+	//! Target the handlers currently dispatch with
+	const HwbpDetail::BreakpointTarget& Current() const noexcept
+	{
+		return *m_target.load(std::memory_order_acquire);
+	}
+
+	//! Swap in a target built by Prepare, the old one is retired until no handler can read it
+	void Publish(std::unique_ptr<HwbpDetail::BreakpointTarget> target) noexcept;
+
+	//! Whether the breakpoint currently holds a debug register
+	bool Armed() const noexcept
+	{
+#if defined(HWBP_WINDOWS)
+		return m_armed;
+#else
+		return m_events.load(std::memory_order_acquire) != nullptr;
+#endif
+	}
+
+#if defined(HWBP_WINDOWS)
+	//! Arm us in a thread context, in the slot we hold there or any slot free in it
+	bool ModifyThreadContext(CONTEXT* ctx, HardwareBreakpoint** slots, const HwbpDetail::BreakpointTarget& target) noexcept;
+
+	//! Write the target's address and DR7 bits into slot `idx`
+	static void ApplySlot(CONTEXT* ctx, int idx, const HwbpDetail::BreakpointTarget& target) noexcept;
+
+	//! Clear our slot (if any) from a thread context
+	void ClearThreadContext(CONTEXT* ctx, HardwareBreakpoint** slots) noexcept;
+
+	//! Clear slot `idx` (address and DR7 bits) from a thread context
+	static void ClearSlot(CONTEXT* ctx, int idx) noexcept;
+
+	//! Get an execute breakpoint's thread past its instruction, see BreakpointResume
+	static void Resume(CONTEXT* ctx, const HwbpDetail::BreakpointTarget& target) noexcept;
 
 	//! Execute a function for each thread
 	template<typename TFunc>
-	void ForEachThread(TFunc f);
+	static void ForEachThread(TFunc f);
+#else
+	//! Describe the breakpoint at `target` as a perf_event
+	perf_event_attr EventAttr(const HwbpDetail::BreakpointTarget& target) const noexcept;
+
+	//! Open a breakpoint event on every thread of the process (or only the owner thread)
+	void OpenEvents(std::vector<BatchThreadResult>& results) noexcept;
+
+	//! Point the open events at `target` without closing them
+	bool ModifyEvents(const HwbpDetail::BreakpointTarget& target) noexcept;
+
+	//! Start or stop delivering hits without releasing anything, safe inside the signal handler
+	void EnableEvents(bool enable) noexcept;
+
+	//! Take the events off the breakpoint and stop them, closing them removes it from all threads
+	std::unique_ptr<HwbpDetail::EventSet> TakeEvents() noexcept;
+#endif
 
 private:
-	//! Address to set an exception on
-	std::uintptr_t		m_address{};
-	//! Appropriated size of the breakpoint
-	BreakpointLength	m_size{};
-	//! Condition to break on (r/rw/ex)
-	BreakpointCondition m_cond{};
-	//! Occupied register index (or -1 if none)
-	std::int32_t		m_regIdx{-1};
-	//! Memory that holds instruction buffer
-	ScopedMemory		m_buffer{};
+	//! Address, condition and resume state, owned and replaced through Publish
+	std::atomic<HwbpDetail::BreakpointTarget*> m_target{ new HwbpDetail::BreakpointTarget{} };
+#if defined(HWBP_WINDOWS)
+	//! Holds a slot in the threads it was committed to, which slot is tracked per thread
+	std::atomic<bool>	m_armed{};
+	//! Bumped whenever a commit arms us, slots written for an older arm are stale
+	std::atomic<std::uint32_t> m_generation{};
+	//! Fired as runOnce, the next commit clears the slots other threads still hold
+	std::atomic<bool>	m_pendingDisarm{};
+	//! Thread a singleThread breakpoint was armed on, later commits edit that thread
+	DWORD				m_ownerThread{};
+#else
+	//! Events of the current arm (null while disarmed), replaced whole by commits
+	std::atomic<HwbpDetail::EventSet*> m_events{};
+	//! Thread a singleThread breakpoint was armed on, events reopened later go there too
+	pid_t				m_ownerThread{};
+#endif
 	//! Breakpoint handler for notification/hooks
 	BreakpointHandler	m_handler;
+	//! The Notify_t inside m_handler, if it is a Notify handler
+	const BreakpointHandler::Notify_t* m_notify{};
 	//! Run on this thread only, or all?
 	bool				m_singleThread{};
+	//! Thread a singleThread breakpoint is pinned to, 0 if none
+	std::uint32_t		m_threadId{};
 	//! Disable after the breakpoint is hit once
 	bool				m_runOnce{};
 	//! Currently disabled?
-	bool				m_disabled{};
+	std::atomic<bool>	m_disabled{};
+	//! Hits seen by the handler (plus, on Linux, counts of events already closed)
+	std::atomic<std::uint64_t> m_hits{};
+	//! Samples dropped on a full ring
+	std::atomic<std::uint64_t> m_lost{};
+	//! Source of m_id
+	static inline std::atomic<std::uint32_t> s_nextId{ 1 };
+	const std::uint32_t	m_id{ s_nextId.fetch_add(1, std::memory_order_relaxed) };
+#if defined(HWBP_WINDOWS)
+	//! Samples recorded by the exception handler
+	std::unique_ptr<SampleRing<BreakpointSample>> m_samples;
+#endif
 };
 
-template<typename TFunc>
-inline void HardwareBreakpoint::ForEachThread(TFunc f)
+//
+// Collects Create/Retarget/Disable operations on several breakpoints and applies
+// the final debug register state with a single context round-trip per thread
+//
+class HardwareBreakpointBatch
 {
-	ScopedHandle hSnapshot{ CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, GetCurrentProcessId()) };
-	if (!hSnapshot.valid())
-		return;
+#if defined(HWBP_WINDOWS)
+	friend void HwbpRebuildThreadImage(const HardwareBreakpointBatch& batch);
+#endif
+
+public:
+	HardwareBreakpointBatch() = default;
+	HardwareBreakpointBatch(const HardwareBreakpointBatch&) = delete;
+
+	//! Queue instantiating a hardware breakpoint
+	bool Create(HardwareBreakpoint& bp, void* address, BreakpointLength size, BreakpointCondition cond, std::optional<BreakpointHandler> handler = std::nullopt) noexcept;
 
-	THREADENTRY32 te32{};
-	te32.dwSize = sizeof(te32);
+	//! Queue moving an already created breakpoint, keeping its debug register
+	bool Retarget(HardwareBreakpoint& bp, void* address, BreakpointLength size, BreakpointCondition cond) noexcept;
 
-	if (Thread32First(hSnapshot, &te32))
+	//! Queue disabling a hardware breakpoint
+	void Disable(HardwareBreakpoint& bp) noexcept;
+
+	//! Apply everything queued, returns false if any thread failed
+	bool Commit() noexcept;
+
+	//! Per-thread outcome of the last Commit
+	const std::vector<BatchThreadResult>& Results() const noexcept
 	{
-		do
-		{
-			if (te32.th32OwnerProcessID == GetCurrentProcessId())
-			{
-				ScopedHandle hThread = OpenThread(THREAD_ALL_ACCESS, FALSE, te32.th32ThreadID);
-				if (hThread.valid())
-					f(hThread);
-			}
-		} while (Thread32Next(hSnapshot, &te32));
+		return m_results;
 	}
+
+private:
+	enum class Op : std::uint8_t
+	{
+		Arm,
+		Retarget,
+		Disarm
+	};
+
+	struct Entry
+	{
+		HardwareBreakpoint* m_bp;
+		Op m_op;
+		//! What Arm and Retarget move the breakpoint to, published by Commit
+		std::unique_ptr<HwbpDetail::BreakpointTarget> m_target{};
+	};
+
+	//! Queued operations, applied in order
+	std::vector<Entry> m_entries;
+	//! Outcome of the last Commit
+	std::vector<BatchThreadResult> m_results;
+};
+
+#if defined(HWBP_WINDOWS)
+template<typename TFunc>
+inline void HardwareBreakpoint::ForEachThread(TFunc f)
+{
+	ThreadRegistry::Get().ForEach(f);
 }
+#endif
 
 void HwbpTerminate();
\ No newline at end of file
@@ -0,0 +1,702 @@
+#include "HardwareBreakpoint.hpp"
+#include "HitQueue.hpp"
+
+#if defined(HWBP_LINUX)
+
+//
+// Linux backend. The kernel owns the debug registers: every breakpoint is a perf_event
+// of type PERF_TYPE_BREAKPOINT opened on each thread with `inherit`, so threads created
+// later get it without any hook, and `sigtrap` delivers a synchronous SIGTRAP to the
+// thread that hit it. Count and Sample handlers skip the signal and let the kernel do
+// the bookkeeping. Requires Linux 5.13+.
+//
+
+#if !defined(TRAP_PERF)
+#define TRAP_PERF 6
+#endif
+
+static EpochRegistry<HardwareBreakpoint> s_hwbpRegistry;
+static struct sigaction s_oldAction{};
+static bool s_signalInstalled{ false };
+static std::mutex s_hookLock;
+
+//
+// Set while a handler runs on this thread, hits raised from inside it are dropped
+static thread_local bool s_inHandler{ false };
+
+void HwbpSignalHandler(int sig, siginfo_t* info, void* uctx);
+void HwbpRetire(std::shared_ptr<void> object) noexcept;
+void HwbpReclaimRetired(EpochRegistry<HardwareBreakpoint>& registry) noexcept;
+
+//
+// perf register numbers (asm/perf_regs.h) sampled for Sample handlers: AX..FLAGS and
+// R8..R15. The kernel writes them in bit order, which is the order of SampleRegister.
+static constexpr std::uint64_t s_sampleRegs = 0x3ff
+#if defined(HWBP_X64)
+	| 0xff0000
+#endif
+	;
+
+//! True if the handler keeps its hits in the event's own counter
+static bool HwbpKernelCounted(const BreakpointHandler& handler) noexcept
+{
+	//
+	// A filtered Count handler takes the signal, only the hits that match are counted
+	if (handler.m_type == BreakpointHandlerType::Count)
+		return !handler.m_filter;
+
+	return handler.m_type == BreakpointHandlerType::Sample;
+}
+
+//! siginfo_t::si_perf_data, which older C libraries don't name
+static std::uintptr_t HwbpPerfData(const siginfo_t* info) noexcept
+{
+#if defined(si_perf_data)
+	return (std::uintptr_t)info->si_perf_data;
+#else
+	//
+	// Right behind si_addr, see asm-generic/siginfo.h
+	std::uintptr_t data{};
+	memcpy(&data, (const std::uint8_t*)&info->si_addr + sizeof(void*), sizeof(data));
+	return data;
+#endif
+}
+
+//! Merge one thread's outcome into the batch results
+static void HwbpRecordResult(std::vector<BatchThreadResult>& results, std::uint32_t tid, int error)
+{
+	auto it = std::find_if(results.begin(), results.end(),
+		[tid](const BatchThreadResult& result) { return result.m_threadId == tid; });
+
+	if (it == results.end())
+	{
+		results.push_back({ tid, error == 0, static_cast<std::uint32_t>(error) });
+	}
+	else if (error != 0)
+	{
+		it->m_success = false;
+		it->m_error = static_cast<std::uint32_t>(error);
+	}
+}
+
+//! Thread ids of this process, from /proc/self/task
+static std::vector<pid_t> HwbpListThreads()
+{
+	std::vector<pid_t> threads;
+
+	DIR* dir = opendir("/proc/self/task");
+	if (!dir)
+		return threads;
+
+	while (dirent* entry = readdir(dir))
+	{
+		if (entry->d_name[0] >= '0' && entry->d_name[0] <= '9')
+			threads.push_back(static_cast<pid_t>(atoi(entry->d_name)));
+	}
+
+	closedir(dir);
+	return threads;
+}
+
+HardwareBreakpoint::HardwareBreakpoint(bool singleThread, bool runOnce, std::uint32_t threadId)
+	: m_singleThread(singleThread || HwbpDetail::SingleThreaded)
+	, m_threadId(threadId)
+	, m_runOnce(runOnce)
+{
+	{
+		std::lock_guard lock(s_hookLock);
+
+		//
+		// Route SIGTRAP through us, keeping whatever was installed to chain to
+		if (!s_signalInstalled)
+		{
+			struct sigaction sa {};
+			sa.sa_sigaction = HwbpSignalHandler;
+			sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+			sigemptyset(&sa.sa_mask);
+
+			s_signalInstalled = sigaction(SIGTRAP, &sa, &s_oldAction) == 0;
+		}
+	}
+
+	s_hwbpRegistry.Insert(this);
+}
+
+HardwareBreakpoint::~HardwareBreakpoint()
+{
+	Disable();
+
+	//
+	// Once this returns no handler can still be looking at us
+	s_hwbpRegistry.Remove(this);
+	delete m_target.load(std::memory_order_relaxed);
+	delete m_events.load(std::memory_order_relaxed);
+}
+
+perf_event_attr HardwareBreakpoint::EventAttr(const HwbpDetail::BreakpointTarget& target) const noexcept
+{
+	perf_event_attr attr{};
+	attr.type = PERF_TYPE_BREAKPOINT;
+	attr.size = sizeof(attr);
+	attr.bp_addr = target.m_address;
+	attr.sample_period = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	if (m_handler.m_type == BreakpointHandlerType::Count && !m_handler.m_filter)
+	{
+		//
+		// Plain counter, no signal and no user mode work per hit
+		attr.sample_period = 0;
+	}
+	else if (m_handler.m_type == BreakpointHandlerType::Sample)
+	{
+		//
+		// The kernel writes a record into the event's ring every Nth hit, the thread
+		// itself never leaves the instruction
+		attr.sample_period = std::get<SampleOptions>(m_handler.m_var).m_period;
+		attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_REGS_USER;
+		attr.sample_regs_user = s_sampleRegs;
+	}
+	else
+	{
+		//
+		// Deliver every hit as a synchronous SIGTRAP carrying our address
+		attr.sigtrap = 1;
+		attr.remove_on_exec = 1;
+		attr.sig_data = (std::uintptr_t)this;
+	}
+
+	//
+	// New threads inherit the event from the thread that created them. The kernel won't
+	// map the ring of an inherited per thread event, so sampling covers only the threads
+	// present when armed.
+	attr.inherit = !m_singleThread && m_handler.m_type != BreakpointHandlerType::Sample;
+	attr.inherit_thread = attr.inherit;
+
+	switch (target.m_cond)
+	{
+	case BreakpointCondition::Execute:
+		attr.bp_type = HW_BREAKPOINT_X;
+		attr.bp_len = sizeof(long);
+		break;
+	case BreakpointCondition::Read:
+		//
+		// DR7 type 01 traps on writes only, x86 has no read-only watchpoints
+		attr.bp_type = HW_BREAKPOINT_W;
+		break;
+	default:
+		attr.bp_type = HW_BREAKPOINT_RW;
+		break;
+	}
+
+	if (target.m_cond != BreakpointCondition::Execute)
+	{
+		switch (target.m_size)
+		{
+		case BreakpointLength::OneByte:
+			attr.bp_len = HW_BREAKPOINT_LEN_1;
+			break;
+		case BreakpointLength::TwoByte:
+			attr.bp_len = HW_BREAKPOINT_LEN_2;
+			break;
+		case BreakpointLength::FourByte:
+			attr.bp_len = HW_BREAKPOINT_LEN_4;
+			break;
+		case BreakpointLength::EightByte:
+			attr.bp_len = HW_BREAKPOINT_LEN_8;
+			break;
+		}
+	}
+
+	return attr;
+}
+
+void HardwareBreakpoint::OpenEvents(std::vector<BatchThreadResult>& results) noexcept
+{
+	perf_event_attr attr = EventAttr(Current());
+	auto events = std::make_unique<HwbpDetail::EventSet>();
+
+	const bool sample = m_handler.m_type == BreakpointHandlerType::Sample;
+	if (sample)
+		events->m_ringSize = (1 + std::get<SampleOptions>(m_handler.m_var).m_pages) * static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+
+	auto open = [&](pid_t tid)
+	{
+		const int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, tid, -1, -1, PERF_FLAG_FD_CLOEXEC));
+
+		if (fd == -1)
+		{
+			//
+			// The thread exited since it was listed
+			if (errno == ESRCH)
+				return;
+
+			FormatError("[!] Error calling perf_event_open (err: {})\n", errno);
+			HwbpRecordResult(results, static_cast<std::uint32_t>(tid), errno);
+			return;
+		}
+
+		if (sample)
+		{
+			//
+			// One metadata page followed by the power of two sized data area
+			void* ring = mmap(nullptr, events->m_ringSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+			if (ring == MAP_FAILED)
+			{
+				const int error = errno;
+				close(fd);
+
+				FormatError("[!] Error mapping the sample ring (err: {})\n", error);
+				HwbpRecordResult(results, static_cast<std::uint32_t>(tid), error);
+				return;
+			}
+
+			events->m_rings.push_back(ring);
+		}
+
+		events->m_fds.push_back(fd);
+		HwbpRecordResult(results, static_cast<std::uint32_t>(tid), 0);
+	};
+
+	if (m_singleThread)
+	{
+		open(m_ownerThread);
+	}
+	else
+	{
+		//
+		// Note: a thread spawned by a not yet armed thread while this runs can be missed
+		for (pid_t tid : HwbpListThreads())
+			open(tid);
+	}
+
+	//
+	// Complete before the handler (or Armed) can see it
+	if (!events->m_fds.empty())
+		m_events.store(events.release(), std::memory_order_release);
+}
+
+bool HardwareBreakpoint::ModifyEvents(const HwbpDetail::BreakpointTarget& target) noexcept
+{
+	perf_event_attr attr = EventAttr(target);
+
+	const HwbpDetail::EventSet* events = m_events.load(std::memory_order_acquire);
+	if (!events)
+		return false;
+
+	//
+	// Only the breakpoint fields may differ from what the events were opened with, the
+	// kernel applies the change to every inherited copy as well
+	for (int fd : events->m_fds)
+	{
+		if (ioctl(fd, PERF_EVENT_IOC_MODIFY_ATTRIBUTES, &attr) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+void HardwareBreakpoint::EnableEvents(bool enable) noexcept
+{
+	const HwbpDetail::EventSet* events = m_events.load(std::memory_order_acquire);
+	if (!events)
+		return;
+
+	//
+	// Also applies to every inherited copy of the event
+	for (int fd : events->m_fds)
+		ioctl(fd, enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+}
+
+//! Hits the kernel counted on a set of events
+static std::uint64_t HwbpEventCount(const HwbpDetail::EventSet& events) noexcept
+{
+	std::uint64_t hits{};
+
+	//
+	// Reading an inherited event sums up every thread it was copied into
+	for (int fd : events.m_fds)
+	{
+		std::uint64_t count{};
+		if (read(fd, &count, sizeof(count)) == sizeof(count))
+			hits += count;
+	}
+
+	return hits;
+}
+
+std::unique_ptr<HwbpDetail::EventSet> HardwareBreakpoint::TakeEvents() noexcept
+{
+	std::unique_ptr<HwbpDetail::EventSet> events{ m_events.exchange(nullptr, std::memory_order_acq_rel) };
+	if (!events)
+		return events;
+
+	for (int fd : events->m_fds)
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+
+	//
+	// Keep what the counters collected so far
+	if (HwbpKernelCounted(m_handler))
+		m_hits.fetch_add(HwbpEventCount(*events), std::memory_order_relaxed);
+
+	return events;
+}
+
+std::uint64_t HardwareBreakpoint::HitCount() const noexcept
+{
+	std::uint64_t hits = m_hits.load(std::memory_order_relaxed);
+
+	if (!HwbpKernelCounted(m_handler))
+		return hits;
+
+	//
+	// A commit on another thread may be taking the events away
+	EpochRegistry<HardwareBreakpoint>::ReadGuard guard{ s_hwbpRegistry };
+
+	if (const HwbpDetail::EventSet* events = m_events.load(std::memory_order_acquire))
+		hits += HwbpEventCount(*events);
+
+	return hits;
+}
+
+//! Copy `size` bytes at `offset` out of a ring's data area, which records may wrap around
+static void HwbpRingCopy(void* dst, const std::uint8_t* data, std::uint64_t dataSize, std::uint64_t offset, std::size_t size) noexcept
+{
+	const std::size_t start = static_cast<std::size_t>(offset & (dataSize - 1));
+	const std::size_t first = std::min<std::size_t>(size, static_cast<std::size_t>(dataSize) - start);
+
+	memcpy(dst, data + start, first);
+	memcpy(static_cast<std::uint8_t*>(dst) + first, data, size - first);
+}
+
+std::size_t HardwareBreakpoint::DrainSamples(BreakpointSample* out, std::size_t count) noexcept
+{
+	constexpr std::size_t regCount = std::popcount(s_sampleRegs);
+
+	//
+	// PERF_RECORD_SAMPLE layout for IP | TID | REGS_USER
+	struct Record
+	{
+		perf_event_header	header;
+		std::uint64_t		ip;
+		std::uint32_t		pid;
+		std::uint32_t		tid;
+		std::uint64_t		abi;
+		std::uint64_t		regs[regCount];
+	};
+
+	std::size_t n = 0;
+
+	EpochRegistry<HardwareBreakpoint>::ReadGuard guard{ s_hwbpRegistry };
+
+	const HwbpDetail::EventSet* events = m_events.load(std::memory_order_acquire);
+	if (!events)
+		return 0;
+
+	for (void* base : events->m_rings)
+	{
+		auto* meta = static_cast<perf_event_mmap_page*>(base);
+		const auto* data = static_cast<const std::uint8_t*>(base) + meta->data_offset;
+		const std::uint64_t dataSize = meta->data_size;
+
+		const std::uint64_t head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+		std::uint64_t tail = meta->data_tail;
+
+		while (tail < head && n < count)
+		{
+			Record record{};
+			HwbpRingCopy(&record.header, data, dataSize, tail, sizeof(record.header));
+
+			if (record.header.type == PERF_RECORD_SAMPLE && record.header.size <= sizeof(record))
+			{
+				HwbpRingCopy(&record, data, dataSize, tail, record.header.size);
+
+				BreakpointSample& sample = out[n++];
+				sample = BreakpointSample{};
+				sample.m_ip = record.ip;
+				sample.m_threadId = record.tid;
+
+				//
+				// No registers when the hit came from a kernel thread
+				if (record.abi != PERF_SAMPLE_REGS_ABI_NONE)
+					std::copy(std::begin(record.regs), std::end(record.regs), std::begin(sample.m_regs));
+			}
+			else if (record.header.type == PERF_RECORD_LOST)
+			{
+				//
+				// { header, id, lost }
+				std::uint64_t lost{};
+				HwbpRingCopy(&lost, data, dataSize, tail + sizeof(record.header) + sizeof(std::uint64_t), sizeof(lost));
+				m_lost.fetch_add(lost, std::memory_order_relaxed);
+			}
+
+			tail += record.header.size;
+		}
+
+		//
+		// Hand the consumed space back to the kernel
+		__atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+	}
+
+	return n;
+}
+
+bool HardwareBreakpointBatch::Commit() noexcept
+{
+	m_results.clear();
+
+	if (m_entries.empty())
+		return true;
+
+	//
+	// Publish every instruction buffer written while queueing
+	TrampolineArena::Get().Seal();
+
+	//
+	// Events taken off the breakpoints below
+	std::vector<std::unique_ptr<HwbpDetail::EventSet>> taken;
+	bool restart{ false };
+
+	for (Entry& entry : m_entries)
+	{
+		HardwareBreakpoint* bp = entry.m_bp;
+
+		//
+		// Move the breakpoint in place, reopening is only the fallback for kernels that
+		// refuse the change. The handler keeps the old target until every event moved.
+		if (entry.m_op == Op::Retarget && bp->ModifyEvents(*entry.m_target))
+		{
+			bp->Publish(std::move(entry.m_target));
+
+			//
+			// A runOnce breakpoint that fired has its events stopped, they start again below
+			restart |= bp->m_disabled.load();
+			continue;
+		}
+
+		//
+		// Stop dispatching before the events go away
+		bp->m_disabled = true;
+
+		if (auto events = bp->TakeEvents())
+			taken.push_back(std::move(events));
+	}
+
+	//
+	// A handler may still be stopping the events just taken, or be about to stop the events
+	// of a runOnce hit it claimed. Wait for it before closing or restarting any. A commit made
+	// from inside a handler can't, a later commit closes the events and until then they keep
+	// their debug registers taken.
+	if (EpochRegistry<HardwareBreakpoint>::InReadSection())
+	{
+		for (auto& events : taken)
+			HwbpRetire(std::move(events));
+	}
+	else if (!taken.empty() || restart)
+	{
+		s_hwbpRegistry.Synchronize();
+		taken.clear();
+	}
+
+	for (Entry& entry : m_entries)
+	{
+		HardwareBreakpoint* bp = entry.m_bp;
+
+		if (entry.m_op == Op::Disarm)
+			continue;
+
+		//
+		// Moved in place (its target was published above)
+		if (!entry.m_target)
+		{
+			if (bp->m_disabled.exchange(false))
+				bp->EnableEvents(true);
+			continue;
+		}
+
+		//
+		// Create arms on the calling (or pinned) thread, a reopened Retarget stays where it was
+		if (entry.m_op == Op::Arm)
+			bp->m_ownerThread = bp->m_threadId ? static_cast<pid_t>(bp->m_threadId) : gettid();
+
+		//
+		// No event left to trap on the old target, the new one can go live
+		bp->Publish(std::move(entry.m_target));
+
+		bp->m_disabled = false;
+		bp->OpenEvents(m_results);
+	}
+
+	m_entries.clear();
+
+	HwbpReclaimRetired(s_hwbpRegistry);
+
+	return std::all_of(m_results.begin(), m_results.end(),
+		[](const BatchThreadResult& result) { return result.m_success; });
+}
+
+//! Hand a SIGTRAP that isn't ours to whoever was installed before us
+static void HwbpChainSignal(int sig, siginfo_t* info, void* uctx)
+{
+	if (s_oldAction.sa_flags & SA_SIGINFO)
+	{
+		if (s_oldAction.sa_sigaction)
+			s_oldAction.sa_sigaction(sig, info, uctx);
+	}
+	else if (s_oldAction.sa_handler == SIG_DFL)
+	{
+		//
+		// Let the default action (core dump) take place
+		sigaction(sig, &s_oldAction, nullptr);
+		raise(sig);
+	}
+	else if (s_oldAction.sa_handler != SIG_IGN)
+	{
+		s_oldAction.sa_handler(sig);
+	}
+}
+
+void HwbpSignalHandler(int sig, siginfo_t* info, void* uctx)
+{
+	if (info->si_code != TRAP_PERF)
+		return HwbpChainSignal(sig, info, uctx);
+
+	//
+	// Returning resumes the thread, for execute breakpoints the kernel already set
+	// EFLAGS.RF so the instruction runs without trapping again
+	if (s_inHandler)
+		return;
+
+	EpochRegistry<HardwareBreakpoint>::ReadGuard guard{ s_hwbpRegistry };
+	HardwareBreakpoint* bp{ nullptr };
+
+	//
+	// sig_data is only trusted once it is found among the live breakpoints
+	const auto data = HwbpPerfData(info);
+
+	for (HardwareBreakpoint* p : guard)
+	{
+		if ((std::uintptr_t)p == data)
+		{
+			bp = p;
+			break;
+		}
+	}
+
+	if (!bp || bp->m_disabled)
+		return;
+
+	HwbpContext ctx{ static_cast<ucontext_t*>(uctx) };
+	const HwbpDetail::BreakpointTarget& target = bp->Current();
+
+#if !defined(HWBP_NO_FILTER)
+	if (bp->m_handler.m_filter && !bp->m_handler.m_filter.Evaluate(&ctx))
+		return;
+#endif
+
+#if !defined(HWBP_NO_RUNONCE)
+	//
+	// Claimed before dispatching, a thread trapping at the same time finds it taken. The
+	// events stop before the handler runs, so it may arm the breakpoint again.
+	if (bp->m_runOnce)
+	{
+		if (bp->m_disabled.exchange(true))
+			return;
+
+		bp->EnableEvents(false);
+	}
+#endif
+
+	bp->m_hits.fetch_add(1, std::memory_order_relaxed);
+
+	HwbpExceptionInfo exception{ info, &ctx };
+
+	if (bp->m_handler.m_type == BreakpointHandlerType::Async)
+		HitQueue::Get().Record(bp->m_id, &ctx, std::get<AsyncOptions>(bp->m_handler.m_var).m_registers);
+
+	s_inHandler = true;
+
+	if (target.m_cond == BreakpointCondition::Execute)
+	{
+		switch (bp->m_handler.m_type)
+		{
+#if !defined(HWBP_NO_HOOK)
+		case BreakpointHandlerType::Hook:
+#if defined(HWBP_X64)
+			ctx.Rip = (greg_t)std::get<void*>(bp->m_handler.m_var);
+#else
+			ctx.Eip = (greg_t)std::get<void*>(bp->m_handler.m_var);
+#endif
+			break;
+#endif
+		case BreakpointHandlerType::Notify:
+			if (bp->m_notify)
+				(*bp->m_notify)(&exception);
+			break;
+		default:
+			break;
+		}
+
+		//
+		// The kernel sets RF on execute breakpoints itself, Trampoline and ResumeFlag both
+		// run the instruction in place
+#if defined(HWBP_X64)
+		const auto ip = (std::uintptr_t)ctx.Rip;
+#else
+		const auto ip = (std::uintptr_t)ctx.Eip;
+#endif
+		if (bp->m_handler.m_type != BreakpointHandlerType::Hook && target.m_resume == BreakpointResume::Emulate && ip == target.m_address)
+		{
+			//
+			// Past the instruction already, RF would hide a breakpoint on the next one
+			if (HwbpDetail::EmulateInstruction(target.m_emulated, &ctx))
+				ctx.EFlags &= ~static_cast<greg_t>(0x10000);
+		}
+	}
+	else if (bp->m_notify) // Data breakpoints trap after the access
+	{
+		(*bp->m_notify)(&exception);
+	}
+
+	s_inHandler = false;
+}
+
+void HwbpTerminate()
+{
+	if (!s_signalInstalled)
+		return;
+
+	//
+	// Disable any hardware breakpoints that may still exist
+	{
+		EpochRegistry<HardwareBreakpoint>::ReadGuard guard{ s_hwbpRegistry };
+
+		for (HardwareBreakpoint* bp : guard)
+		{
+			bp->Disable();
+		}
+	}
+
+	//
+	// The commits above ran inside the guard, close the events they took
+	HwbpReclaimRetired(s_hwbpRegistry);
+
+	//
+	// Lastly, give SIGTRAP back. Only if we are still the one installed: a handler put in
+	// place after us (PageWatch) chains to ours and would be removed along with it. Ours
+	// then stays in its chain, passing everything on, and is not installed a second time.
+	struct sigaction current {};
+
+	if (sigaction(SIGTRAP, nullptr, &current) != 0 || !(current.sa_flags & SA_SIGINFO) ||
+		current.sa_sigaction != HwbpSignalHandler)
+	{
+		return;
+	}
+
+	sigaction(SIGTRAP, &s_oldAction, nullptr);
+	s_signalInstalled = false;
+}
+
+#endif
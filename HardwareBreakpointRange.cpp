@@ -0,0 +1,89 @@
+#include "HardwareBreakpointRange.hpp"
+
+HardwareBreakpointRange::HardwareBreakpointRange(bool singleThread)
+	: m_singleThread(singleThread)
+{
+}
+
+HardwareBreakpointRange::~HardwareBreakpointRange()
+{
+	Disable();
+}
+
+bool HardwareBreakpointRange::WatchRange(void* address, std::size_t length, BreakpointCondition cond, std::optional<BreakpointHandler> handler) noexcept
+{
+	if (m_count != 0 || length == 0)
+		return false;
+
+	Piece pieces[MaxPieces]{};
+	std::size_t count{};
+
+	if (cond == BreakpointCondition::Execute)
+	{
+		//
+		// An instruction fetch only ever needs its first byte
+		pieces[0] = { (std::uintptr_t)address, BreakpointLength::OneByte };
+		count = 1;
+	}
+	else
+	{
+		count = Decompose((std::uintptr_t)address, length, pieces, MaxPieces);
+	}
+
+	if (count > MaxPieces)
+	{
+		FormatError("[!] Range {:#x}+{} needs {} debug registers\n", (std::uintptr_t)address, length, count);
+		return false;
+	}
+
+	//
+	// Arm every piece in one go, nothing is touched if any of them is refused
+	HardwareBreakpointBatch batch;
+
+	for (std::size_t i = 0; i < count; i++)
+	{
+		if (!m_pieces[i])
+			m_pieces[i] = std::make_unique<HardwareBreakpoint>(m_singleThread);
+
+		if (!batch.Create(*m_pieces[i], (void*)pieces[i].m_address, pieces[i].m_size, cond, handler))
+			return false;
+	}
+
+	m_count = count;
+
+	if (!batch.Commit())
+	{
+		FormatError("[!] Unable to arm range {:#x}+{}\n", (std::uintptr_t)address, length);
+		Disable();
+		return false;
+	}
+
+	return true;
+}
+
+void HardwareBreakpointRange::Disable() noexcept
+{
+	HardwareBreakpointBatch batch;
+
+	for (std::size_t i = 0; i < m_count; i++)
+		batch.Disable(*m_pieces[i]);
+
+	batch.Commit();
+
+	//
+	// The pieces are kept, the next range creates them again
+	m_count = 0;
+}
+
+std::uint64_t HardwareBreakpointRange::HitCount() const noexcept
+{
+	std::uint64_t hits{};
+
+	for (const auto& piece : m_pieces)
+	{
+		if (piece)
+			hits += piece->HitCount();
+	}
+
+	return hits;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "HardwareBreakpoint.hpp"
+
+#include <memory>
+
+//
+// Watches an arbitrary [address, address + length) with as many debug registers as it
+// takes. The range is split into naturally aligned 1/2/4/8 byte pieces that cover exactly
+// its bytes, so every hit touched the range, and all pieces are armed in one batch (or
+// none is). Ranges needing more than four pieces are refused, PageWatch covers those.
+//
+// Note: an access spanning two pieces may be counted once per piece.
+//
+class HardwareBreakpointRange
+{
+public:
+	struct Piece
+	{
+		std::uintptr_t		m_address{};
+		BreakpointLength	m_size{};
+	};
+
+	//! Largest piece a debug register can cover
+#if defined(HWBP_X64)
+	static constexpr std::size_t MaxPiece = 8;
+#else
+	static constexpr std::size_t MaxPiece = 4;
+#endif
+
+	static constexpr std::size_t MaxPieces = 4;
+
+	HardwareBreakpointRange(const HardwareBreakpointRange&) = delete;
+	HardwareBreakpointRange(bool singleThread = false);
+	~HardwareBreakpointRange();
+
+	//! Watch `length` bytes at `address`
+	bool WatchRange(void* address, std::size_t length, BreakpointCondition cond, std::optional<BreakpointHandler> handler = std::nullopt) noexcept;
+
+	//! Watch a single object, its size and alignment must fit the debug registers
+	template<typename T>
+	bool Watch(T* field, BreakpointCondition cond = BreakpointCondition::ReadWrite, std::optional<BreakpointHandler> handler = std::nullopt) noexcept
+	{
+		static_assert(WorstCasePieces(sizeof(T), alignof(T)) <= MaxPieces,
+			"Type can't be covered by the debug registers at its alignment, use PageWatch");
+
+		return WatchRange((void*)field, sizeof(T), cond, handler);
+	}
+
+	//! Disable every piece
+	void Disable() noexcept;
+
+	//! Hits summed over every piece, including ranges watched before
+	std::uint64_t HitCount() const noexcept;
+
+	//! Split a range into aligned pieces, returns how many it takes (only the first `max` are written)
+	static constexpr std::size_t Decompose(std::uintptr_t address, std::size_t length, Piece* out = nullptr, std::size_t max = 0) noexcept
+	{
+		std::size_t count = 0;
+
+		while (length != 0)
+		{
+			//
+			// Largest power of two the address is aligned to that still fits
+			std::size_t size = MaxPiece;
+			while ((address & (size - 1)) != 0 || size > length)
+				size /= 2;
+
+			if (count < max)
+				out[count] = { address, LengthOf(size) };
+
+			count++;
+			address += size;
+			length -= size;
+		}
+
+		return count;
+	}
+
+	//! Most pieces an object of `size` bytes can need at any address aligned to `align`
+	static constexpr std::size_t WorstCasePieces(std::size_t size, std::size_t align) noexcept
+	{
+		std::size_t worst = 0;
+
+		for (std::size_t offset = 0; offset < MaxPiece; offset += align)
+			worst = std::max(worst, Decompose(offset, size));
+
+		return worst;
+	}
+
+private:
+	static constexpr BreakpointLength LengthOf(std::size_t size) noexcept
+	{
+		switch (size)
+		{
+		case 2:
+			return BreakpointLength::TwoByte;
+		case 4:
+			return BreakpointLength::FourByte;
+		case 8:
+			return BreakpointLength::EightByte;
+		default:
+			return BreakpointLength::OneByte;
+		}
+	}
+
+private:
+	//! One breakpoint per piece, created on first use
+	std::unique_ptr<HardwareBreakpoint> m_pieces[MaxPieces];
+	//! Pieces of the current range
+	std::size_t		m_count{};
+	bool			m_singleThread{};
+};
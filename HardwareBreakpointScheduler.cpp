@@ -0,0 +1,188 @@
+#include "HardwareBreakpointScheduler.hpp"
+
+HardwareBreakpointScheduler::HardwareBreakpointScheduler(std::size_t slots, bool singleThread)
+	: m_slots(std::clamp<std::size_t>(slots, 1, 4))
+{
+	//
+	// Pinned to us, the rotation may run on Start's thread
+#if defined(HWBP_WINDOWS)
+	const std::uint32_t threadId = GetCurrentThreadId();
+#else
+	const std::uint32_t threadId = static_cast<std::uint32_t>(gettid());
+#endif
+
+	for (Slot& slot : m_slots)
+		slot.m_bp = std::make_unique<HardwareBreakpoint>(singleThread, false, threadId);
+}
+
+HardwareBreakpointScheduler::~HardwareBreakpointScheduler()
+{
+	Stop();
+}
+
+std::size_t HardwareBreakpointScheduler::Add(void* address, BreakpointLength size, BreakpointCondition cond)
+{
+	std::lock_guard lock(m_lock);
+
+	Watch watch{};
+	watch.m_address = (std::uintptr_t)address;
+	watch.m_size = size;
+	watch.m_cond = cond;
+
+	m_watches.push_back(watch);
+	return m_watches.size() - 1;
+}
+
+void HardwareBreakpointScheduler::Remove(std::size_t id)
+{
+	std::lock_guard lock(m_lock);
+
+	if (id < m_watches.size())
+		m_watches[id].m_removed = true;
+}
+
+void HardwareBreakpointScheduler::Settle(Clock::time_point now) noexcept
+{
+	for (Slot& slot : m_slots)
+	{
+		if (slot.m_watch == -1)
+			continue;
+
+		const std::uint64_t count = slot.m_bp->HitCount();
+
+		Watch& watch = m_watches[slot.m_watch];
+		watch.m_hits += count - slot.m_lastCount;
+		watch.m_armed += now - slot.m_since;
+
+		slot.m_lastCount = count;
+		slot.m_since = now;
+	}
+}
+
+bool HardwareBreakpointScheduler::Rotate() noexcept
+{
+	std::lock_guard lock(m_lock);
+
+	const auto now = Clock::now();
+	Settle(now);
+
+	//
+	// Pick the next watches round robin, wrapping at most once
+	std::vector<std::ptrdiff_t> next;
+
+	for (std::size_t i = 0; i < m_watches.size() && next.size() < m_slots.size(); i++)
+	{
+		const std::size_t idx = (m_cursor + i) % m_watches.size();
+
+		if (!m_watches[idx].m_removed)
+			next.push_back(static_cast<std::ptrdiff_t>(idx));
+	}
+
+	if (!next.empty())
+		m_cursor = (next.back() + 1) % m_watches.size();
+
+	for (Watch& watch : m_watches)
+		watch.m_turns += !watch.m_removed;
+
+	for (std::ptrdiff_t idx : next)
+		m_watches[idx].m_armedTurns++;
+
+	next.resize(m_slots.size(), -1);
+
+	//
+	// Move all slots with one context round-trip per thread
+	HardwareBreakpointBatch batch;
+
+	BreakpointHandler handler{};
+	handler.m_type = BreakpointHandlerType::Count;
+
+	for (std::size_t i = 0; i < m_slots.size(); i++)
+	{
+		Slot& slot = m_slots[i];
+
+		if (slot.m_watch == next[i])
+			continue;
+
+		slot.m_watch = next[i];
+		slot.m_lastCount = slot.m_bp->HitCount();
+		slot.m_since = now;
+
+		if (slot.m_watch == -1)
+		{
+			batch.Disable(*slot.m_bp);
+			continue;
+		}
+
+		const Watch& watch = m_watches[slot.m_watch];
+
+		//
+		// Keep the debug register once a slot has one, see HardwareBreakpoint::Retarget
+		if (!batch.Retarget(*slot.m_bp, (void*)watch.m_address, watch.m_size, watch.m_cond) &&
+			!batch.Create(*slot.m_bp, (void*)watch.m_address, watch.m_size, watch.m_cond, handler))
+		{
+			FormatError("[!] Unable to schedule watch {} at {:#x}\n", slot.m_watch, watch.m_address);
+			slot.m_watch = -1;
+		}
+	}
+
+	return batch.Commit();
+}
+
+#if !defined(HWBP_SINGLE_THREADED)
+void HardwareBreakpointScheduler::Start(std::chrono::microseconds quantum)
+{
+	Stop();
+
+	m_stop = false;
+	m_thread = std::thread([this, quantum]
+		{
+			std::unique_lock lock(m_lock);
+
+			while (!m_stop)
+			{
+				lock.unlock();
+				Rotate();
+				lock.lock();
+
+				m_wake.wait_for(lock, quantum, [this] { return m_stop; });
+			}
+		});
+}
+#endif
+
+void HardwareBreakpointScheduler::Stop()
+{
+	if (!m_thread.joinable())
+		return;
+
+	{
+		std::lock_guard lock(m_lock);
+		m_stop = true;
+	}
+
+	m_wake.notify_all();
+	m_thread.join();
+}
+
+HardwareBreakpointScheduler::Estimate HardwareBreakpointScheduler::Stats(std::size_t id)
+{
+	std::lock_guard lock(m_lock);
+
+	Estimate estimate{};
+
+	if (id >= m_watches.size())
+		return estimate;
+
+	const auto now = Clock::now();
+	Settle(now);
+
+	const Watch& watch = m_watches[id];
+	const double armed = std::chrono::duration<double>(watch.m_armed).count();
+
+	estimate.m_observedHits = watch.m_hits;
+	estimate.m_dutyCycle = watch.m_turns ? static_cast<double>(watch.m_armedTurns) / watch.m_turns : 0;
+	estimate.m_hitRate = armed > 0 ? watch.m_hits / armed : 0;
+	estimate.m_estimatedHits = estimate.m_dutyCycle > 0 ? watch.m_hits / estimate.m_dutyCycle : 0;
+
+	return estimate;
+}
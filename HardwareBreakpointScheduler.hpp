@@ -0,0 +1,104 @@
+#pragma once
+
+#include "HardwareBreakpoint.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <thread>
+
+//
+// Watches more locations than there are debug registers by rotating them through a few
+// physical breakpoints. Every logical watch only counts hits while it holds a slot, so
+// its totals are extrapolated by its duty cycle (turns armed / turns registered). The
+// duty cycle is counted in turns rather than time, trapping is slow enough that turns
+// with busy watches armed last longer and would skew a time based one. The estimate is
+// statistical, bursts that fall outside a watch's turns are not seen.
+//
+// Rotation is driven either by the owner calling Rotate (round robin on whatever cadence
+// suits it, e.g. once per frame) or by Start, which rotates every quantum on a
+// background thread. A singleThread scheduler watches the thread that constructed it,
+// whichever thread rotates.
+//
+class HardwareBreakpointScheduler
+{
+	using Clock = std::chrono::steady_clock;
+
+public:
+	struct Estimate
+	{
+		//! Hits counted while the watch was armed
+		std::uint64_t	m_observedHits{};
+		//! Turns armed / turns registered
+		double			m_dutyCycle{};
+		//! Observed hits per second of armed time
+		double			m_hitRate{};
+		//! Observed hits scaled up to every turn since registration
+		double			m_estimatedHits{};
+	};
+
+	//! `slots` physical breakpoints (at most 4, less if others are needed elsewhere)
+	explicit HardwareBreakpointScheduler(std::size_t slots = 4, bool singleThread = false);
+	HardwareBreakpointScheduler(const HardwareBreakpointScheduler&) = delete;
+	~HardwareBreakpointScheduler();
+
+	//! Register a logical watch, returns its id (armed on the next rotation)
+	std::size_t Add(void* address, BreakpointLength size, BreakpointCondition cond);
+
+	//! Stop watching, the id is not reused
+	void Remove(std::size_t id);
+
+	//! Settle the counts and hand the slots to the next group of watches
+	bool Rotate() noexcept;
+
+#if !defined(HWBP_SINGLE_THREADED)
+	//! Rotate every `quantum` on a background thread until Stop
+	void Start(std::chrono::microseconds quantum);
+#endif
+
+	//! Stop the background rotation, the current assignment stays armed
+	void Stop();
+
+	//! Current estimate for a watch
+	Estimate Stats(std::size_t id);
+
+private:
+	struct Watch
+	{
+		std::uintptr_t		m_address{};
+		BreakpointLength	m_size{};
+		BreakpointCondition	m_cond{};
+		bool				m_removed{};
+		//! Rotations since registration / of those, holding a slot
+		std::uint64_t		m_turns{};
+		std::uint64_t		m_armedTurns{};
+		//! Accumulated while holding a slot
+		Clock::duration		m_armed{};
+		std::uint64_t		m_hits{};
+	};
+
+	struct Slot
+	{
+		std::unique_ptr<HardwareBreakpoint> m_bp;
+		//! Watch currently armed in this slot (-1 if none)
+		std::ptrdiff_t		m_watch{ -1 };
+		//! HitCount at the last settle
+		std::uint64_t		m_lastCount{};
+		Clock::time_point	m_since{};
+	};
+
+	//! Credit every slot's hits and armed time to its watch, up to `now`
+	void Settle(Clock::time_point now) noexcept;
+
+private:
+	std::vector<Slot>		m_slots;
+	std::vector<Watch>		m_watches;
+	//! Next watch to hand a slot to
+	std::size_t				m_cursor{};
+	//! Guards everything above
+	std::mutex				m_lock;
+
+	std::thread				m_thread;
+	std::condition_variable	m_wake;
+	bool					m_stop{};
+};
@@ -0,0 +1,111 @@
+#include "hde/hde64/include/hde64.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+//
+// Decode throughput of hde64: walks the bytes of a binary (this program unless a path is
+// given) instruction by instruction, once filling a full hde64s per instruction with
+// hde64_disasm and once asking hde64_length for the length alone, which is all the
+// trampoline relocation and the resume paths need. hde64_disasm_batch then decodes the same
+// bytes into its column arrays, a chunk of Capacity instructions per call.
+//
+// Build and run, e.g.
+//   g++ -std=c++20 -O2 -I. HdeBench.cpp hde/hde64/src/hde64.cpp
+//   ./a.out [file]
+//
+
+static constexpr int Passes = 20;
+static constexpr std::uint32_t Capacity = 4096;
+
+//! Decodes the buffer Passes times with decode, returns the instructions per second
+template<typename Decode>
+static double Measure(const std::vector<unsigned char>& code, std::size_t size, Decode decode)
+{
+	std::size_t instructions = 0;
+	const auto start = std::chrono::steady_clock::now();
+
+	for (int pass = 0; pass < Passes; pass++)
+	{
+		for (std::size_t offset = 0; offset < size; instructions++)
+			offset += decode(&code[offset]);
+	}
+
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	return instructions / elapsed.count();
+}
+
+int main(int argc, char** argv)
+{
+	const char* path = argc > 1 ? argv[1] : "/proc/self/exe";
+	FILE* file = fopen(path, "rb");
+
+	if (!file)
+	{
+		perror(path);
+		return 1;
+	}
+
+	std::vector<unsigned char> code;
+	unsigned char buffer[65536];
+
+	for (std::size_t read; (read = fread(buffer, 1, sizeof(buffer), file)) != 0;)
+		code.insert(code.end(), buffer, buffer + read);
+
+	fclose(file);
+
+	//! The decoders may read up to 15 bytes past the last instruction started
+	const std::size_t size = code.size();
+	code.resize(size + 16);
+
+	const double disasm = Measure(code, size, [](const void* at)
+		{
+			hde64s hs;
+			return hde64_disasm(at, &hs);
+		});
+
+	const double length = Measure(code, size, [](const void* at)
+		{
+			return hde64_length(at);
+		});
+
+	//! Only the columns a relocation pass reads
+	std::vector<std::uint32_t> offsets(Capacity), flags(Capacity);
+	std::vector<std::uint8_t> lengths(Capacity);
+	std::vector<std::uint64_t> targets(Capacity);
+
+	hde64_batch batch{};
+	batch.offset = offsets.data();
+	batch.len = lengths.data();
+	batch.flags = flags.data();
+	batch.target = targets.data();
+	batch.capacity = Capacity;
+
+	std::size_t instructions = 0;
+	const auto start = std::chrono::steady_clock::now();
+
+	for (int pass = 0; pass < Passes; pass++)
+	{
+		for (std::size_t offset = 0; offset < size;)
+		{
+			const std::size_t consumed = hde64_disasm_batch(&code[offset], size - offset, offset, &batch);
+			instructions += batch.count;
+
+			//! An instruction running past the end is left out, step over its bytes
+			offset += consumed ? consumed : size - offset;
+		}
+	}
+
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	const double batched = instructions / elapsed.count();
+
+	printf("$ %s, %zu bytes\n", path, size);
+	printf("$ hde64_disasm: %.1f M instructions/s\n", disasm / 1e6);
+	printf("$ hde64_length: %.1f M instructions/s (%.2fx)\n", length / 1e6, length / disasm);
+	printf("$ hde64_disasm_batch: %.1f M instructions/s (%.2fx)\n", batched / 1e6, batched / disasm);
+
+	return 0;
+}
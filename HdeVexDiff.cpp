@@ -0,0 +1,214 @@
+#include "hde/hde64/include/hde64.h"
+#include "hde/hde32/include/hde32.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+//
+// Differential test of the VEX, EVEX and XOP paths in hde64/hde32 against GNU objdump.
+// Random instructions behind each of those prefixes are written out at a fixed stride with
+// nop padding, so objdump falls back in step after each one, and the length it reports is
+// compared with hde's. Instructions objdump can't decode are skipped, only disagreements on
+// ones it accepts fail. Needs objdump from binutils 2.40 or newer on the PATH.
+//
+// Build and run, e.g.
+//   g++ -std=c++20 -O2 -I. HdeVexDiff.cpp hde/hde64/src/hde64.cpp hde/hde32/src/hde32.cpp
+//   ./a.out [count] [seed]
+//
+
+static constexpr std::size_t Stride = 32;
+
+struct Encoding
+{
+	const char*	m_name;
+	std::uint8_t	m_prefix;
+};
+
+static constexpr Encoding Encodings[] =
+{
+	{ "vex2", 0xc5 },
+	{ "vex3", 0xc4 },
+	{ "evex", 0x62 },
+	{ "xop", 0x8f },
+};
+
+//
+// Fills one instruction at out: the prefix, payload bytes that keep it in the prefix's
+// encoding space, then random opcode, modrm, sib, displacement and immediate bytes.
+//
+static void Generate(std::mt19937& random, const Encoding& encoding, bool x64, std::uint8_t* out)
+{
+	for (std::size_t i = 0; i < Stride; i++)
+		out[i] = i < 16 ? static_cast<std::uint8_t>(random()) : 0x90;
+
+	out[0] = encoding.m_prefix;
+
+	//! Outside long mode c4/c5/62 are les/lds/bound unless the next byte looks like mod == 3
+	if (!x64 && encoding.m_prefix != 0x8f)
+		out[1] |= 0xc0;
+
+	switch (encoding.m_prefix)
+	{
+	case 0xc4:
+		out[1] = (out[1] & 0xe0) | (1 + random() % 3);
+		break;
+	case 0x62:
+		out[1] = (out[1] & 0xf0) | (1 + random() % 3);
+		out[2] |= 0x04;
+		break;
+	case 0x8f:
+		out[1] = (out[1] & 0xe0) | (8 + random() % 3);
+		break;
+	}
+}
+
+struct Reference
+{
+	std::size_t	m_length{};
+	bool		m_valid{};
+	std::string	m_text;
+};
+
+//
+// Runs objdump over the buffer and returns what it decoded at each stride boundary
+//
+static std::vector<Reference> Disassemble(const std::vector<std::uint8_t>& code, bool x64)
+{
+	std::vector<Reference> references(code.size() / Stride);
+
+	char path[] = "/tmp/hdevexdiffXXXXXX";
+	const int fd = mkstemp(path);
+
+	if (fd == -1 || write(fd, code.data(), code.size()) != static_cast<ssize_t>(code.size()))
+	{
+		perror("temporary file");
+		exit(2);
+	}
+
+	close(fd);
+
+	const std::string command = std::string("objdump -D -b binary --insn-width=16 -m ")
+		+ (x64 ? "i386:x86-64 " : "i386 ") + path;
+
+	FILE* pipe = popen(command.c_str(), "r");
+
+	if (!pipe)
+	{
+		perror("objdump");
+		exit(2);
+	}
+
+	char line[512];
+
+	while (fgets(line, sizeof(line), pipe))
+	{
+		//! "  addr:\tbytes \tmnemonic operands"
+		char* bytes = strchr(line, '\t');
+		char* colon = strchr(line, ':');
+
+		if (!bytes || !colon || colon > bytes)
+			continue;
+
+		char* end = nullptr;
+		const std::size_t address = strtoull(line, &end, 16);
+
+		if (end != colon || address % Stride != 0)
+			continue;
+
+		char* text = strchr(bytes + 1, '\t');
+
+		if (!text)
+			continue;
+
+		*text++ = '\0';
+		text[strcspn(text, "\n")] = '\0';
+
+		Reference& reference = references[address / Stride];
+
+		//! The byte column is padded to the full width with spaces
+		for (char* byte = strtok(bytes + 1, " "); byte; byte = strtok(nullptr, " "))
+			reference.m_length++;
+
+		reference.m_valid = !strstr(text, "bad") && !strstr(text, ".byte");
+		reference.m_text = text;
+	}
+
+	pclose(pipe);
+	unlink(path);
+
+	return references;
+}
+
+static unsigned int Decode(const std::uint8_t* code, bool x64)
+{
+	if (x64)
+	{
+		hde64s hs;
+		return hde64_disasm(code, &hs);
+	}
+
+	hde32s hs;
+	return hde32_disasm(code, &hs);
+}
+
+int main(int argc, char** argv)
+{
+	const std::size_t count = argc > 1 ? strtoull(argv[1], nullptr, 0) : 20000;
+	const unsigned int seed = argc > 2 ? static_cast<unsigned int>(strtoul(argv[2], nullptr, 0)) : 1;
+
+	int failures = 0;
+
+	for (bool x64 : { true, false })
+	{
+		for (const Encoding& encoding : Encodings)
+		{
+			std::mt19937 random(seed);
+			std::vector<std::uint8_t> code(count * Stride);
+
+			for (std::size_t i = 0; i < count; i++)
+				Generate(random, encoding, x64, &code[i * Stride]);
+
+			const auto references = Disassemble(code, x64);
+			std::size_t compared = 0, mismatches = 0;
+
+			for (std::size_t i = 0; i < count; i++)
+			{
+				const Reference& reference = references[i];
+
+				if (!reference.m_valid)
+					continue;
+
+				compared++;
+
+				const unsigned int length = Decode(&code[i * Stride], x64);
+
+				if (length == reference.m_length)
+					continue;
+
+				if (mismatches++ < 10)
+				{
+					printf("  %s %s: hde %u objdump %zu:", x64 ? "x64" : "x86", encoding.m_name, length, reference.m_length);
+
+					for (std::size_t k = 0; k < reference.m_length; k++)
+						printf(" %02x", code[i * Stride + k]);
+
+					printf("  %s\n", reference.m_text.c_str());
+				}
+			}
+
+			printf("$ %s %s: %zu of %zu accepted by objdump, %zu mismatches\n", x64 ? "x64" : "x86", encoding.m_name,
+				compared, count, mismatches);
+
+			failures += mismatches != 0;
+		}
+	}
+
+	printf("$ %d failures\n", failures);
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,254 @@
+#include "HitQueue.hpp"
+
+#if defined(HWBP_LINUX)
+#include <poll.h>
+#include <sys/eventfd.h>
+#endif
+
+HitQueue::HitQueue()
+{
+#if defined(HWBP_WINDOWS)
+	m_event = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+#else
+	m_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+#endif
+}
+
+HitQueue::~HitQueue()
+{
+	Stop();
+
+#if defined(HWBP_WINDOWS)
+	if (m_event)
+		CloseHandle(m_event);
+#else
+	if (m_event != -1)
+		close(m_event);
+#endif
+}
+
+bool HitQueue::Configure(const HitQueueOptions& options) noexcept
+{
+	std::lock_guard lock(m_setupLock);
+
+	if (m_ready.load(std::memory_order_acquire))
+	{
+		FormatError("[!] HitQueue is in use already, it can't be reconfigured\n");
+		return false;
+	}
+
+	m_options = options;
+	return true;
+}
+
+bool HitQueue::Reserve() noexcept
+{
+	std::lock_guard lock(m_setupLock);
+
+	if (m_ready.load(std::memory_order_acquire))
+		return true;
+
+	const std::uint32_t rings = std::max(m_options.m_rings, 1u);
+	const std::uint64_t capacity = std::bit_ceil(std::max<std::uint64_t>(m_options.m_capacity, 2));
+
+	auto pool = std::unique_ptr<Ring[]>(new (std::nothrow) Ring[rings]);
+	if (!pool)
+		return false;
+
+	for (std::uint32_t i = 0; i < rings; i++)
+	{
+		pool[i].m_records.reset(new (std::nothrow) BreakpointHit[capacity]);
+
+		if (!pool[i].m_records)
+		{
+			FormatError("[!] Unable to allocate the hit rings\n");
+			return false;
+		}
+	}
+
+	m_pool = std::move(pool);
+	m_poolSize = rings;
+	m_capacity = capacity;
+	m_overflow = m_options.m_overflow;
+
+	m_ready.store(true, std::memory_order_release);
+	return true;
+}
+
+HitQueue::Ring* HitQueue::Claim() noexcept
+{
+	if (!m_ready.load(std::memory_order_acquire))
+		return nullptr;
+
+#if defined(HWBP_WINDOWS)
+	const auto tid = static_cast<std::uint32_t>(GetCurrentThreadId());
+#else
+	const auto tid = static_cast<std::uint32_t>(gettid());
+#endif
+
+	for (std::uint32_t i = 0; i < m_poolSize; i++)
+	{
+		Ring& ring = m_pool[i];
+		std::uint32_t expected = 0;
+
+		if (ring.m_owner.load(std::memory_order_relaxed) == 0 &&
+			ring.m_owner.compare_exchange_strong(expected, tid, std::memory_order_acquire))
+		{
+			s_ownRing = &ring;
+			return &ring;
+		}
+	}
+
+	//
+	// Let the consumer look for rings of threads that are gone
+	m_starved.store(true, std::memory_order_relaxed);
+	return nullptr;
+}
+
+std::size_t HitQueue::Drain(const Consumer_t& consumer) noexcept
+{
+	if (!m_ready.load(std::memory_order_acquire))
+		return 0;
+
+	std::lock_guard lock(m_drainLock);
+
+	//
+	// Cleared before looking, a hit queued from here on wakes us again
+	m_pending.exchange(false, std::memory_order_acq_rel);
+
+	const bool reclaim = m_starved.exchange(false, std::memory_order_relaxed);
+	BreakpointHit batch[BatchSize];
+	std::size_t total = 0;
+
+	for (std::uint32_t i = 0; i < m_poolSize; i++)
+	{
+		Ring& ring = m_pool[i];
+
+		const std::uint32_t owner = ring.m_owner.load(std::memory_order_acquire);
+		if (owner == 0)
+			continue;
+
+		std::uint64_t tail = ring.m_tail.load(std::memory_order_relaxed);
+
+		while (true)
+		{
+			const std::uint64_t head = ring.m_head.load(std::memory_order_acquire);
+			if (head == tail)
+				break;
+
+			//
+			// Overwritten before we got to them (DropOldest)
+			if (head - tail > m_capacity)
+			{
+				m_dropped.fetch_add(head - m_capacity - tail, std::memory_order_relaxed);
+				tail = head - m_capacity;
+			}
+
+			const std::size_t n = static_cast<std::size_t>(std::min<std::uint64_t>(head - tail, BatchSize));
+
+			for (std::size_t j = 0; j < n; j++)
+				batch[j] = ring.m_records[(tail + j) & (m_capacity - 1)];
+
+			//
+			// Records the producer started overwriting while we copied them are torn
+			std::size_t skip = 0;
+
+			if (m_overflow == HitOverflow::DropOldest)
+			{
+				std::atomic_thread_fence(std::memory_order_acquire);
+
+				const std::uint64_t reserved = ring.m_reserved.load(std::memory_order_relaxed);
+				if (reserved > m_capacity + tail)
+					skip = static_cast<std::size_t>(std::min<std::uint64_t>(reserved - m_capacity - tail, n));
+
+				m_dropped.fetch_add(skip, std::memory_order_relaxed);
+			}
+
+			if (n > skip && consumer)
+				consumer(batch + skip, n - skip);
+
+			total += n - skip;
+			tail += n;
+			ring.m_tail.store(tail, std::memory_order_release);
+		}
+
+		//
+		// Nothing left to read and nobody left to write, the ring can go to another thread
+		if (reclaim && ThreadExited(owner))
+			ring.m_owner.store(0, std::memory_order_release);
+	}
+
+	return total;
+}
+
+void HitQueue::Start(Consumer_t consumer, std::chrono::milliseconds interval)
+{
+	Stop();
+
+	m_consumer = std::move(consumer);
+	m_stop = false;
+
+	m_thread = std::thread([this, interval]
+		{
+			while (!m_stop.load(std::memory_order_acquire))
+			{
+				Wait(interval);
+				Drain(m_consumer);
+			}
+
+			//
+			// Whatever was queued until Stop
+			Drain(m_consumer);
+		});
+}
+
+void HitQueue::Stop()
+{
+	if (!m_thread.joinable())
+		return;
+
+	m_stop.store(true, std::memory_order_release);
+	Signal();
+
+	m_thread.join();
+}
+
+void HitQueue::Signal() noexcept
+{
+#if defined(HWBP_WINDOWS)
+	SetEvent(m_event);
+#else
+	//
+	// write(2) is async signal safe, the handler may call this
+	const std::uint64_t one = 1;
+	[[maybe_unused]] const auto written = write(m_event, &one, sizeof(one));
+#endif
+}
+
+void HitQueue::Wait(std::chrono::milliseconds interval) noexcept
+{
+#if defined(HWBP_WINDOWS)
+	WaitForSingleObject(m_event, static_cast<DWORD>(interval.count()));
+#else
+	pollfd pfd{ m_event, POLLIN, 0 };
+
+	if (poll(&pfd, 1, static_cast<int>(interval.count())) > 0)
+	{
+		std::uint64_t count{};
+		[[maybe_unused]] const auto read = ::read(m_event, &count, sizeof(count));
+	}
+#endif
+}
+
+bool HitQueue::ThreadExited(std::uint32_t tid) noexcept
+{
+#if defined(HWBP_WINDOWS)
+	ScopedHandle hThread{ OpenThread(SYNCHRONIZE, FALSE, tid) };
+	if (!hThread.valid())
+		return GetLastError() == ERROR_INVALID_PARAMETER;
+
+	return WaitForSingleObject(hThread, 0) == WAIT_OBJECT_0;
+#else
+	return syscall(SYS_tgkill, getpid(), static_cast<pid_t>(tid), 0) == -1 && errno == ESRCH;
+#endif
+}
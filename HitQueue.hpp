@@ -0,0 +1,266 @@
+#pragma once
+
+#include "HardwareBreakpoint.hpp"
+
+#include <chrono>
+#include <memory>
+#include <thread>
+
+enum class HitOverflow : std::uint8_t
+{
+	DropNewest,	// A full ring keeps its records, the new hit is dropped
+	DropOldest	// A full ring overwrites its oldest record
+};
+
+struct HitQueueOptions
+{
+	//! Records each thread's ring holds, rounded up to a power of two
+	std::uint32_t	m_capacity{ 1024 };
+	//! Rings in the pool, one per thread that hits an Async breakpoint
+	std::uint32_t	m_rings{ 64 };
+	HitOverflow		m_overflow{ HitOverflow::DropNewest };
+};
+
+//
+// Delivery of Async breakpoint hits. The exception handler only copies a BreakpointHit into
+// a ring owned by the thread that took the hit (one producer, one consumer, no lock), and
+// a consumer hands every ring's records to a callback in batches: Start runs one on a
+// background thread, or an event loop waiting on Event() calls Drain itself.
+//
+// Rings come from a pool allocated before the first Async breakpoint is armed, nothing is
+// allocated on the hit path. A thread that finds no free ring drops its hits; rings of
+// threads that exited are handed back by the consumer once the pool runs dry.
+//
+class HitQueue
+{
+public:
+	using Consumer_t = TDelegate<void(const BreakpointHit*, std::size_t)>;
+
+	//! Records handed to the consumer per call at most
+	static constexpr std::size_t BatchSize = 64;
+
+	HitQueue(const HitQueue&) = delete;
+
+	static HitQueue& Get()
+	{
+		static HitQueue s_instance;
+		return s_instance;
+	}
+
+	//! Size the pool, only possible before it is allocated (the first Async breakpoint)
+	bool Configure(const HitQueueOptions& options) noexcept;
+
+	//! Allocate the pool if it doesn't exist yet, never called from the handlers
+	bool Reserve() noexcept;
+
+	//! Queue a hit of `breakpointId`, from the exception handler of the thread that took it
+	template<typename Context>
+	void Record(std::uint32_t breakpointId, const Context* ctx, std::uint32_t registers) noexcept;
+
+	//! Hand everything queued so far to `consumer`, returns how many records it got
+	std::size_t Drain(const Consumer_t& consumer) noexcept;
+
+	//! Drain on a background thread whenever hits arrive, and at least every `interval`
+	void Start(Consumer_t consumer, std::chrono::milliseconds interval = std::chrono::milliseconds(100));
+
+	//! Stop the background consumer after a last drain
+	void Stop();
+
+	//! Hits lost to full rings or to an exhausted pool
+	std::uint64_t Dropped() const noexcept
+	{
+		return m_dropped.load(std::memory_order_relaxed);
+	}
+
+#if defined(HWBP_WINDOWS)
+	//! Auto-reset event set when a hit is queued after a drain
+	HANDLE Event() const noexcept
+	{
+		return m_event;
+	}
+#else
+	//! eventfd that becomes readable when a hit is queued after a drain (epoll friendly)
+	int Event() const noexcept
+	{
+		return m_event;
+	}
+#endif
+
+private:
+	struct alignas(64) Ring
+	{
+		//! Thread writing into the ring, 0 while free
+		std::atomic<std::uint32_t>	m_owner{};
+		//! Records written, and the record being written (runs ahead of m_head meanwhile)
+		alignas(64) std::atomic<std::uint64_t> m_head{};
+		std::atomic<std::uint64_t>	m_reserved{};
+		//! Records consumed
+		alignas(64) std::atomic<std::uint64_t> m_tail{};
+		std::unique_ptr<BreakpointHit[]> m_records;
+	};
+
+	HitQueue();
+	~HitQueue();
+
+	//! Take a free ring for the current thread
+	Ring* Claim() noexcept;
+
+	//! Wake the consumer
+	void Signal() noexcept;
+
+	//! Block the background consumer until Signal or `interval`
+	void Wait(std::chrono::milliseconds interval) noexcept;
+
+	//! Whether the thread owning a ring is gone
+	static bool ThreadExited(std::uint32_t tid) noexcept;
+
+	//! Value of the register a SampleRegister names
+	template<typename Context>
+	static std::uint64_t Register(const Context* ctx, SampleRegister reg) noexcept;
+
+private:
+	//! Ring the current thread claimed
+	static inline thread_local Ring* s_ownRing{};
+
+	std::unique_ptr<Ring[]>	m_pool;
+	std::uint32_t			m_poolSize{};
+	std::uint64_t			m_capacity{};
+	HitOverflow				m_overflow{};
+	//! m_pool and the fields above are published
+	std::atomic<bool>		m_ready{};
+	//! What Reserve sets the pool up with
+	HitQueueOptions			m_options{};
+	//! Guards the pool setup
+	std::mutex				m_setupLock;
+
+	std::atomic<std::uint64_t> m_dropped{};
+	//! A hit was queued since the consumer last looked
+	std::atomic<bool>		m_pending{};
+	//! A thread found no free ring
+	std::atomic<bool>		m_starved{};
+	//! One consumer at a time
+	std::mutex				m_drainLock;
+
+#if defined(HWBP_WINDOWS)
+	HANDLE					m_event{};
+#else
+	int						m_event{ -1 };
+#endif
+	std::thread				m_thread;
+	std::atomic<bool>		m_stop{};
+	Consumer_t				m_consumer;
+};
+
+template<typename Context>
+inline std::uint64_t HitQueue::Register(const Context* ctx, SampleRegister reg) noexcept
+{
+	switch (reg)
+	{
+#if defined(HWBP_X64)
+	case SampleRegister::Rax:
+		return ctx->Rax;
+	case SampleRegister::Rbx:
+		return ctx->Rbx;
+	case SampleRegister::Rcx:
+		return ctx->Rcx;
+	case SampleRegister::Rdx:
+		return ctx->Rdx;
+	case SampleRegister::Rsi:
+		return ctx->Rsi;
+	case SampleRegister::Rdi:
+		return ctx->Rdi;
+	case SampleRegister::Rbp:
+		return ctx->Rbp;
+	case SampleRegister::Rsp:
+		return ctx->Rsp;
+	case SampleRegister::Rip:
+		return ctx->Rip;
+	case SampleRegister::R8:
+		return ctx->R8;
+	case SampleRegister::R9:
+		return ctx->R9;
+	case SampleRegister::R10:
+		return ctx->R10;
+	case SampleRegister::R11:
+		return ctx->R11;
+	case SampleRegister::R12:
+		return ctx->R12;
+	case SampleRegister::R13:
+		return ctx->R13;
+	case SampleRegister::R14:
+		return ctx->R14;
+	case SampleRegister::R15:
+		return ctx->R15;
+#else
+	case SampleRegister::Rax:
+		return ctx->Eax;
+	case SampleRegister::Rbx:
+		return ctx->Ebx;
+	case SampleRegister::Rcx:
+		return ctx->Ecx;
+	case SampleRegister::Rdx:
+		return ctx->Edx;
+	case SampleRegister::Rsi:
+		return ctx->Esi;
+	case SampleRegister::Rdi:
+		return ctx->Edi;
+	case SampleRegister::Rbp:
+		return ctx->Ebp;
+	case SampleRegister::Rsp:
+		return ctx->Esp;
+	case SampleRegister::Rip:
+		return ctx->Eip;
+#endif
+	case SampleRegister::EFlags:
+		return ctx->EFlags;
+	default:
+		return 0;
+	}
+}
+
+template<typename Context>
+inline void HitQueue::Record(std::uint32_t breakpointId, const Context* ctx, std::uint32_t registers) noexcept
+{
+	Ring* ring = s_ownRing ? s_ownRing : Claim();
+
+	if (!ring)
+	{
+		m_dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	const std::uint64_t head = ring->m_head.load(std::memory_order_relaxed);
+
+	if (m_overflow == HitOverflow::DropNewest && head - ring->m_tail.load(std::memory_order_acquire) == m_capacity)
+	{
+		m_dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	//
+	// Announce the slot before writing it, a consumer still copying the record it held
+	// (DropOldest) sees the overwrite coming and discards its copy
+	ring->m_reserved.store(head + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	BreakpointHit& hit = ring->m_records[head & (m_capacity - 1)];
+	hit.m_timestamp = static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+	hit.m_threadId = ring->m_owner.load(std::memory_order_relaxed);
+	hit.m_breakpointId = breakpointId;
+	hit.m_ip = Register(ctx, SampleRegister::Rip);
+
+	std::size_t n = 0;
+
+	for (std::uint32_t bits = registers; bits != 0 && n < std::size(hit.m_regs); bits &= bits - 1)
+		hit.m_regs[n++] = Register(ctx, static_cast<SampleRegister>(std::countr_zero(bits)));
+
+	for (; n < std::size(hit.m_regs); n++)
+		hit.m_regs[n] = 0;
+
+	ring->m_head.store(head + 1, std::memory_order_release);
+
+	//
+	// Only the first hit after a drain wakes the consumer
+	if (!m_pending.load(std::memory_order_relaxed) && !m_pending.exchange(true, std::memory_order_acq_rel))
+		Signal();
+}
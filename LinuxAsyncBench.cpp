@@ -0,0 +1,99 @@
+#include "HitQueue.hpp"
+
+#include <chrono>
+
+//
+// What a hit costs the thread that takes it, by handler: an empty Notify, a Notify that
+// formats and writes a log line (the work Async is meant to move off the hot thread) and
+// an Async handler queueing two registers. Async runs twice, drained only afterwards (the
+// record copy alone) and with HitQueue::Start consuming on another thread, whose wakeups
+// compete with the hot thread when both share a core.
+//
+// Build with every source but Main.cpp, e.g.
+//   g++ -std=c++20 -O2 -I. LinuxAsyncBench.cpp HardwareBreakpoint.cpp HardwareBreakpointLinux.cpp
+//     HardwareBreakpointRange.cpp HardwareBreakpointScheduler.cpp HitQueue.cpp PageWatch.cpp
+//     hde/hde64/src/hde64.cpp -lpthread
+//
+
+static constexpr int Hits = 20000;
+
+static volatile std::uintptr_t s_field;
+static FILE* s_log;
+static std::uint64_t s_notified;
+static std::atomic<std::uint64_t> s_consumed{};
+
+static void OnHit(HwbpExceptionInfo*)
+{
+	s_notified++;
+}
+
+static void OnHitLogged(HwbpExceptionInfo* info)
+{
+	fprintf(s_log, "hit at %llx, field %llu\n", static_cast<unsigned long long>(info->ContextRecord->Rip),
+		static_cast<unsigned long long>(s_field));
+	fflush(s_log);
+}
+
+static void Consume(const BreakpointHit*, std::size_t count)
+{
+	s_consumed.fetch_add(count, std::memory_order_relaxed);
+}
+
+static double Measure(const BreakpointHandler& handler)
+{
+	HardwareBreakpoint breakpoint;
+
+	if (!breakpoint.Create((void*)&s_field, BreakpointLength::EightByte, BreakpointCondition::ReadWrite, handler))
+		return -1;
+
+	const auto start = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < Hits; i++)
+		s_field = i;
+
+	const auto elapsed = std::chrono::steady_clock::now() - start;
+
+	return std::chrono::duration<double, std::nano>(elapsed).count() / Hits;
+}
+
+int main()
+{
+	s_log = fopen("/dev/null", "w");
+
+	BreakpointHandler notify{};
+	notify.m_type = BreakpointHandlerType::Notify;
+	notify.m_var = BreakpointHandler::Notify_t::Bind<&OnHit>();
+
+	BreakpointHandler logged{};
+	logged.m_type = BreakpointHandlerType::Notify;
+	logged.m_var = BreakpointHandler::Notify_t::Bind<&OnHitLogged>();
+
+	BreakpointHandler async{};
+	async.m_type = BreakpointHandlerType::Async;
+	async.m_var = AsyncOptions{ (1u << static_cast<int>(SampleRegister::Rax)) | (1u << static_cast<int>(SampleRegister::Rsp)) };
+
+	//! Holds a whole run, nothing is dropped while no consumer runs
+	HitQueueOptions options{};
+	options.m_capacity = Hits;
+	HitQueue::Get().Configure(options);
+
+	printf("$ empty notify:     %6.0f ns/hit\n", Measure(notify));
+	printf("$ logged notify:    %6.0f ns/hit\n", Measure(logged));
+	printf("$ async, no reader: %6.0f ns/hit\n", Measure(async));
+
+	HitQueue::Get().Drain(HitQueue::Consumer_t::Bind<&Consume>());
+	HitQueue::Get().Start(HitQueue::Consumer_t::Bind<&Consume>(), std::chrono::milliseconds(1));
+
+	printf("$ async, consumer:  %6.0f ns/hit\n", Measure(async));
+
+	HitQueue::Get().Stop();
+	HitQueue::Get().Drain(HitQueue::Consumer_t::Bind<&Consume>());
+
+	printf("$ %llu notifications, %llu records consumed, %llu dropped\n", static_cast<unsigned long long>(s_notified),
+		static_cast<unsigned long long>(s_consumed.load()), static_cast<unsigned long long>(HitQueue::Get().Dropped()));
+
+	HwbpTerminate();
+	fclose(s_log);
+
+	return 0;
+}
@@ -0,0 +1,91 @@
+#include "HardwareBreakpoint.hpp"
+
+#include <chrono>
+
+//
+// Measures what the build options in HardwareBreakpoint.hpp buy on the hit path: the cost
+// of a data hit with a Notify handler and of one rejected by a filter on Linux. Build it
+// once per configuration and compare the numbers and the `size` of the binaries, e.g.
+//   for opts in "" "-DHWBP_NO_HOOK -DHWBP_NO_SAMPLE -DHWBP_NO_RUNONCE" "-DHWBP_SINGLE_THREADED"; do
+//     g++ -std=c++20 -O2 -I. $opts LinuxDispatchBench.cpp HardwareBreakpoint.cpp HardwareBreakpointLinux.cpp
+//       HardwareBreakpointRange.cpp HardwareBreakpointScheduler.cpp HitQueue.cpp PageWatch.cpp
+//       hde/hde64/src/hde64.cpp -lpthread -o bench && size bench && ./bench
+//   done
+//
+
+static constexpr int Hits = 20000;
+
+static volatile std::uintptr_t s_field;
+static std::uint64_t s_notified;
+
+static void OnHit(HwbpExceptionInfo*)
+{
+	s_notified++;
+}
+
+static double Measure(const BreakpointHandler& handler)
+{
+	HardwareBreakpoint breakpoint;
+
+	if (!breakpoint.Create((void*)&s_field, BreakpointLength::EightByte, BreakpointCondition::ReadWrite, handler))
+		return -1;
+
+	const auto start = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < Hits; i++)
+		s_field = i;
+
+	const auto elapsed = std::chrono::steady_clock::now() - start;
+
+	return std::chrono::duration<double, std::nano>(elapsed).count() / Hits;
+}
+
+int main()
+{
+	printf("$ hook=%d sample=%d runonce=%d filter=%d single_threaded=%d log_sink=%d\n",
+#if defined(HWBP_NO_HOOK)
+		0,
+#else
+		1,
+#endif
+#if defined(HWBP_NO_SAMPLE)
+		0,
+#else
+		1,
+#endif
+#if defined(HWBP_NO_RUNONCE)
+		0,
+#else
+		1,
+#endif
+#if defined(HWBP_NO_FILTER)
+		0,
+#else
+		1,
+#endif
+		HwbpDetail::SingleThreaded ? 1 : 0,
+#if defined(HWBP_LOG_SINK)
+		1
+#else
+		0
+#endif
+	);
+
+	BreakpointHandler notify{};
+	notify.m_type = BreakpointHandlerType::Notify;
+	notify.m_var = BreakpointHandler::Notify_t::Bind<&OnHit>();
+
+	printf("$ notify: %.0f ns/hit\n", Measure(notify));
+
+	//! The filter never matches, so every hit is resumed right after evaluating it
+	BreakpointHandler filtered{};
+	filtered.m_type = BreakpointHandlerType::Count;
+	filtered.m_filter.Compile("rax == 0xffffffffffff");
+
+	printf("$ filtered count: %.0f ns/hit\n", Measure(filtered));
+	printf("$ %llu notifications\n", static_cast<unsigned long long>(s_notified));
+
+	HwbpTerminate();
+
+	return 0;
+}
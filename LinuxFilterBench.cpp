@@ -0,0 +1,94 @@
+#include "HardwareBreakpoint.hpp"
+
+#include <chrono>
+
+//
+// Cost of a hit a BreakpointFilter rejects on Linux, next to an accepted one: an execute
+// breakpoint on a function taking (key, object) runs with a condition over a register
+// only, one that also reads memory through process_vm_readv, and none at all. None of
+// the conditions ever match, so the filtered handlers must see no hits.
+//
+// Build with every source but Main.cpp, e.g.
+//   g++ -std=c++20 -O2 -I. LinuxFilterBench.cpp HardwareBreakpoint.cpp HardwareBreakpointLinux.cpp
+//     HardwareBreakpointRange.cpp HardwareBreakpointScheduler.cpp HitQueue.cpp PageWatch.cpp
+//     hde/hde64/src/hde64.cpp -lpthread
+//
+
+static constexpr int Hits = 20000;
+
+struct Object
+{
+	long	m_pad;
+	long	m_value;
+};
+
+static std::uint64_t s_notified;
+
+__attribute__((noinline)) static long FilterTarget(long key, Object* object)
+{
+	asm volatile("");
+	return key + object->m_value;
+}
+
+static void OnHit(HwbpExceptionInfo*)
+{
+	s_notified++;
+}
+
+//! Returns ns per hit, `accepted` receives the hits the filter let through
+static double Measure(const char* condition, std::uint64_t& accepted)
+{
+	BreakpointHandler handler{};
+	handler.m_type = BreakpointHandlerType::Notify;
+	handler.m_var = BreakpointHandler::Notify_t::Bind<&OnHit>();
+
+	if (condition && !handler.m_filter.Compile(condition))
+		return -1;
+
+	HardwareBreakpoint breakpoint;
+
+	if (!breakpoint.Create((void*)&FilterTarget, BreakpointLength::OneByte, BreakpointCondition::Execute, handler))
+		return -1;
+
+	Object object{ 0, 20 };
+	const std::uint64_t before = s_notified;
+	const auto start = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < Hits; i++)
+		FilterTarget(i, &object);
+
+	const auto elapsed = std::chrono::steady_clock::now() - start;
+	accepted = s_notified - before;
+
+	return std::chrono::duration<double, std::nano>(elapsed).count() / Hits;
+}
+
+int main()
+{
+	static constexpr const char* Conditions[] =
+	{
+		nullptr,
+		"rdi == 0xffffffff",
+		"rdi == 0xffffffff || qword[rsi + 8] == 12345",
+	};
+
+	int failures = 0;
+
+	for (const char* condition : Conditions)
+	{
+		std::uint64_t accepted = 0;
+		const double cost = Measure(condition, accepted);
+
+		printf("$ %-46s %6.0f ns/hit, %llu accepted\n", condition ? condition : "(no filter)", cost,
+			static_cast<unsigned long long>(accepted));
+
+		if (cost < 0 || accepted != (condition ? 0 : Hits))
+			failures++;
+	}
+
+	printf("$ %d failures\n", failures);
+
+	HwbpTerminate();
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,94 @@
+#include "HardwareBreakpoint.hpp"
+
+#include <chrono>
+
+//
+// Per-hit latency of each BreakpointResume strategy on Linux: an execute breakpoint sits on
+// an instruction Emulate can run on the context (push rbx) and on one it can't (lea), with
+// a Notify handler that does nothing. The kernel resumes perf breakpoints in place, so
+// Trampoline and ResumeFlag should cost the same and only Emulate saves anything; on
+// Windows the three take different paths out of the exception handler.
+//
+// Build with every source but Main.cpp, e.g.
+//   g++ -std=c++20 -O2 -I. LinuxResumeBench.cpp HardwareBreakpoint.cpp HardwareBreakpointLinux.cpp
+//     HardwareBreakpointRange.cpp HardwareBreakpointScheduler.cpp HitQueue.cpp PageWatch.cpp
+//     hde/hde64/src/hde64.cpp -lpthread
+//
+
+extern "C" long ResumeTarget(long value);
+
+asm(R"(
+	.text
+	.globl ResumeTarget
+ResumeTarget:
+	push %rbx
+	mov %rdi, %rbx
+ResumeTargetLea:
+	lea 1(%rbx), %rax
+	pop %rbx
+	ret
+)");
+
+extern "C" char ResumeTargetLea[];
+
+static constexpr int Hits = 20000;
+
+static std::uint64_t s_notified;
+
+static void OnHit(HwbpExceptionInfo*)
+{
+	s_notified++;
+}
+
+static double Measure(void* address, BreakpointResume resume)
+{
+	BreakpointHandler handler{};
+	handler.m_type = BreakpointHandlerType::Notify;
+	handler.m_resume = resume;
+	handler.m_var = BreakpointHandler::Notify_t::Bind<&OnHit>();
+
+	HardwareBreakpoint breakpoint;
+
+	if (!breakpoint.Create(address, BreakpointLength::OneByte, BreakpointCondition::Execute, handler))
+		return -1;
+
+	long sum = 0;
+	const auto start = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < Hits; i++)
+		sum += ResumeTarget(i);
+
+	const auto elapsed = std::chrono::steady_clock::now() - start;
+
+	//! Every strategy has to leave the function computing the same thing
+	if (sum != static_cast<long>(Hits) * (Hits + 1) / 2)
+		return -1;
+
+	return std::chrono::duration<double, std::nano>(elapsed).count() / Hits;
+}
+
+int main()
+{
+	static constexpr struct
+	{
+		const char*		m_name;
+		BreakpointResume	m_resume;
+	} Strategies[] =
+	{
+		{ "Trampoline", BreakpointResume::Trampoline },
+		{ "ResumeFlag", BreakpointResume::ResumeFlag },
+		{ "Emulate", BreakpointResume::Emulate },
+	};
+
+	for (const auto& strategy : Strategies)
+	{
+		printf("$ %-10s push rbx: %6.0f ns/hit, lea: %6.0f ns/hit\n", strategy.m_name,
+			Measure((void*)&ResumeTarget, strategy.m_resume), Measure(ResumeTargetLea, strategy.m_resume));
+	}
+
+	printf("$ %llu notifications\n", static_cast<unsigned long long>(s_notified));
+
+	HwbpTerminate();
+
+	return 0;
+}
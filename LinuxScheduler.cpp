@@ -0,0 +1,72 @@
+#include "HardwareBreakpointScheduler.hpp"
+
+#include <thread>
+
+//
+// Checks HardwareBreakpointScheduler on Linux with the perf backend: five watches rotate
+// through two breakpoints on Start's background thread while this thread writes two of
+// them. A singleThread scheduler must still see this thread's writes, and neither kind
+// may count writes to watches nobody touches.
+//
+// Build with every source but Main.cpp, e.g.
+//   g++ -std=c++20 -O2 -I. LinuxScheduler.cpp HardwareBreakpoint.cpp HardwareBreakpointLinux.cpp
+//     HardwareBreakpointRange.cpp HardwareBreakpointScheduler.cpp HitQueue.cpp PageWatch.cpp
+//     hde/hde64/src/hde64.cpp -lpthread
+//
+
+static constexpr int Watches = 5;
+static constexpr int Rounds = 400;
+
+static volatile std::uintptr_t s_fields[Watches];
+
+static int Run(bool singleThread)
+{
+	HardwareBreakpointScheduler scheduler(2, singleThread);
+	std::size_t ids[Watches]{};
+
+	for (int i = 0; i < Watches; i++)
+		ids[i] = scheduler.Add((void*)&s_fields[i], BreakpointLength::EightByte, BreakpointCondition::ReadWrite);
+
+	scheduler.Start(std::chrono::microseconds(200));
+
+	for (int round = 0; round < Rounds; round++)
+	{
+		for (int k = 0; k < 100; k++)
+		{
+			s_fields[0] = k;
+			s_fields[3] = k;
+		}
+
+		std::this_thread::sleep_for(std::chrono::microseconds(50));
+	}
+
+	scheduler.Stop();
+
+	int failures = 0;
+
+	for (int i = 0; i < Watches; i++)
+	{
+		const auto estimate = scheduler.Stats(ids[i]);
+		const bool written = i == 0 || i == 3;
+
+		printf("$ %s watch %d: observed %llu, duty %.2f, estimated %.0f of %d\n", singleThread ? "singleThread" : "process",
+			i, static_cast<unsigned long long>(estimate.m_observedHits), estimate.m_dutyCycle, estimate.m_estimatedHits,
+			written ? Rounds * 100 : 0);
+
+		if (written ? estimate.m_observedHits == 0 : estimate.m_observedHits != 0)
+			failures++;
+	}
+
+	return failures;
+}
+
+int main()
+{
+	const int failures = Run(true) + Run(false);
+
+	printf("$ %d failures\n", failures);
+
+	HwbpTerminate();
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,90 @@
+#include "HardwareBreakpoint.hpp"
+
+#include <thread>
+
+//
+// Stress test for the breakpoint registry on Linux: 64 threads construct, arm, hit, disable
+// and destroy breakpoints as fast as they can, while one more thread keeps committing a
+// process wide watch under all of them. A handler reaching a destroyed breakpoint, or a
+// Remove waiting on a reader that never leaves, shows up as a crash or a hang.
+//
+// Build with every source but Main.cpp, e.g.
+//   g++ -std=c++20 -O2 -I. LinuxStress.cpp HardwareBreakpoint.cpp HardwareBreakpointLinux.cpp
+//     HardwareBreakpointRange.cpp HardwareBreakpointScheduler.cpp HitQueue.cpp PageWatch.cpp
+//     hde/hde64/src/hde64.cpp -lpthread
+//
+
+static constexpr int Threads = 64;
+static constexpr int Rounds = 1000;
+
+static volatile std::uintptr_t s_slots[Threads];
+static volatile std::uintptr_t s_shared;
+static std::atomic<std::uint64_t> s_notified{};
+static std::atomic<int> s_failures{};
+static std::atomic<bool> s_stop{};
+
+int main()
+{
+	BreakpointHandler handler{};
+	handler.m_type = BreakpointHandlerType::Notify;
+	handler.m_var = [](HwbpExceptionInfo*)
+	{
+		s_notified.fetch_add(1, std::memory_order_relaxed);
+	};
+
+	//! Churn a process wide watch, every commit walks all the threads below
+	std::thread churn([&handler]
+		{
+			while (!s_stop.load())
+			{
+				HardwareBreakpoint breakpoint;
+				breakpoint.Create((void*)&s_shared, BreakpointLength::EightByte, BreakpointCondition::ReadWrite, handler);
+				breakpoint.Disable();
+			}
+		});
+
+	//! Each thread arms a breakpoint of its own (singleThread, one debug register each)
+	std::vector<std::thread> workers;
+
+	for (int t = 0; t < Threads; t++)
+	{
+		workers.emplace_back([t, &handler]
+			{
+				for (int round = 0; round < Rounds; round++)
+				{
+					HardwareBreakpoint breakpoint(true);
+
+					if (!breakpoint.Create((void*)&s_slots[t], BreakpointLength::EightByte, BreakpointCondition::ReadWrite, handler))
+					{
+						s_failures++;
+						continue;
+					}
+
+					s_slots[t] = round;
+					s_shared = round;
+
+					if (breakpoint.HitCount() != 1)
+						s_failures++;
+
+					breakpoint.Disable();
+					s_slots[t] = round;
+
+					if (breakpoint.HitCount() != 1)
+						s_failures++;
+				}
+			});
+	}
+
+	for (auto& worker : workers)
+		worker.join();
+
+	s_stop = true;
+	churn.join();
+
+	printf("$ %d threads x %d rounds, %d failures, %llu notifications\n", Threads, Rounds, s_failures.load(),
+		static_cast<unsigned long long>(s_notified.load()));
+
+	HwbpTerminate();
+
+	return s_failures.load() == 0 ? 0 : 1;
+}
@@ -0,0 +1,609 @@
+#include "PageWatch.hpp"
+
+#include <map>
+
+static EpochRegistry<PageWatch> s_pageRegistry;
+static std::mutex s_pageLock;
+static bool s_handlerInstalled{ false };
+
+//
+// Pages shared between watches, with the protection they had before the first one
+struct PageRef
+{
+	std::uint32_t m_refs;
+	std::uint32_t m_original;
+};
+
+static std::map<std::uintptr_t, PageRef> s_pages;
+
+//
+// Steps whose watches didn't all fit in PendingStep, every Disable waits for these
+static std::atomic<std::uint32_t> s_stepping{};
+
+//
+// Pages this thread opened, closed again by the single step. A handler touching another
+// watched page only adds to it, the step of the outer access closes both. The step is
+// counted on each watch owning one of the pages until then.
+struct PendingStep
+{
+	static constexpr std::uint32_t MaxPages = 4;
+	static constexpr std::uint32_t MaxWatches = 8;
+
+	std::uintptr_t	m_pages[MaxPages];
+	std::uint32_t	m_original[MaxPages];
+	std::uint32_t	m_count;
+	PageWatch*		m_watches[MaxWatches];
+	std::uint32_t	m_watchCount;
+	//! Counted in s_stepping instead, for watches beyond MaxWatches
+	bool			m_overflow;
+	bool			m_inHandler;
+	//! Instruction and address of the access dispatched for this step
+	std::uintptr_t	m_ip;
+	std::uintptr_t	m_address;
+};
+
+static thread_local PendingStep s_step{};
+
+//
+// EFLAGS.TF, traps after the next instruction
+static constexpr std::uintptr_t TrapFlag = 0x100;
+
+#if defined(HWBP_WINDOWS)
+static PVOID s_vehHandle{ nullptr };
+
+LONG WINAPI PageWatchExceptionHandler(EXCEPTION_POINTERS* pException);
+
+static bool PageQueryProtection(std::uintptr_t page, std::uint32_t& protection) noexcept
+{
+	MEMORY_BASIC_INFORMATION mbi{};
+
+	if (!VirtualQuery((void*)page, &mbi, sizeof(mbi)) || mbi.State != MEM_COMMIT)
+		return false;
+
+	protection = mbi.Protect;
+	return true;
+}
+
+static bool PageSetProtection(std::uintptr_t page, std::uint32_t protection) noexcept
+{
+	DWORD old{};
+	return VirtualProtect((void*)page, PageWatch::PageSize, protection, &old);
+}
+#else
+static struct sigaction s_oldFault{};
+static struct sigaction s_oldTrap{};
+
+#if !defined(TRAP_TRACE)
+#define TRAP_TRACE 2
+#endif
+
+void PageWatchFaultHandler(int sig, siginfo_t* info, void* uctx);
+void PageWatchTrapHandler(int sig, siginfo_t* info, void* uctx);
+
+static bool PageQueryProtection(std::uintptr_t page, std::uint32_t& protection) noexcept
+{
+	FILE* maps = fopen("/proc/self/maps", "r");
+	if (!maps)
+		return false;
+
+	bool found{ false };
+	unsigned long lo{}, hi{};
+	char perms[5]{};
+	char line[512];
+
+	while (fgets(line, sizeof(line), maps))
+	{
+		if (sscanf(line, "%lx-%lx %4s", &lo, &hi, perms) != 3 || page < lo || page >= hi)
+			continue;
+
+		protection = (perms[0] == 'r' ? PROT_READ : 0) | (perms[1] == 'w' ? PROT_WRITE : 0) | (perms[2] == 'x' ? PROT_EXEC : 0);
+		found = true;
+		break;
+	}
+
+	fclose(maps);
+	return found;
+}
+
+static bool PageSetProtection(std::uintptr_t page, std::uint32_t protection) noexcept
+{
+	return mprotect((void*)page, PageWatch::PageSize, static_cast<int>(protection)) == 0;
+}
+
+//! Hand a signal that isn't ours to whoever was installed before us
+static void PageWatchChain(struct sigaction& old, int sig, siginfo_t* info, void* uctx)
+{
+	if (old.sa_flags & SA_SIGINFO)
+	{
+		if (old.sa_sigaction)
+			old.sa_sigaction(sig, info, uctx);
+	}
+	else if (old.sa_handler == SIG_DFL)
+	{
+		sigaction(sig, &old, nullptr);
+		raise(sig);
+	}
+	else if (old.sa_handler != SIG_IGN)
+	{
+		old.sa_handler(sig);
+	}
+}
+#endif
+
+PageWatch::PageWatch(bool runOnce)
+	: m_runOnce(runOnce)
+{
+	{
+		std::lock_guard lock(s_pageLock);
+
+		if (!s_handlerInstalled)
+		{
+#if defined(HWBP_WINDOWS)
+			//
+			// First in line, guard page violations are only ever ours or a stack probe's
+			s_vehHandle = AddVectoredExceptionHandler(1, PageWatchExceptionHandler);
+			s_handlerInstalled = s_vehHandle != nullptr;
+#else
+			struct sigaction sa {};
+			sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+			sigemptyset(&sa.sa_mask);
+
+			sa.sa_sigaction = PageWatchFaultHandler;
+			s_handlerInstalled = sigaction(SIGSEGV, &sa, &s_oldFault) == 0;
+
+			sa.sa_sigaction = PageWatchTrapHandler;
+			s_handlerInstalled = s_handlerInstalled && sigaction(SIGTRAP, &sa, &s_oldTrap) == 0;
+#endif
+		}
+	}
+
+	s_pageRegistry.Insert(this);
+}
+
+PageWatch::~PageWatch()
+{
+	Disable();
+
+	s_pageRegistry.Remove(this);
+}
+
+bool PageWatch::Create(void* address, std::size_t length, BreakpointCondition cond, std::optional<BreakpointHandler> handler) noexcept
+{
+	if (m_armed || length == 0 || cond == BreakpointCondition::IOReadWrite)
+		return false;
+
+	if (handler.has_value())
+		m_handler = handler.value();
+
+	if (m_handler.m_type == BreakpointHandlerType::Hook || m_handler.m_type == BreakpointHandlerType::Sample ||
+		m_handler.m_type == BreakpointHandlerType::Async)
+	{
+		m_handler.m_type = BreakpointHandlerType::None;
+		FormatError("[!] Invalid BreakpointHandlerType (page watches only notify or count)\n");
+	}
+
+	if (m_handler.m_filter)
+	{
+		m_handler.m_filter = {};
+		FormatError("[!] Page watches don't support filters\n");
+	}
+
+	m_notify = nullptr;
+
+	if (m_handler.m_type == BreakpointHandlerType::Notify)
+	{
+		const auto* notify = std::get_if<BreakpointHandler::Notify_t>(&m_handler.m_var);
+		if (notify && *notify)
+			m_notify = notify;
+	}
+
+	m_begin = (std::uintptr_t)address;
+	m_end = m_begin + length;
+	m_cond = cond;
+
+	{
+		std::lock_guard lock(s_pageLock);
+
+		for (std::uintptr_t page = m_begin & ~(PageSize - 1); page < m_end; page += PageSize)
+		{
+			auto it = s_pages.find(page);
+
+			if (it == s_pages.end())
+			{
+				std::uint32_t original{};
+
+				if (!PageQueryProtection(page, original))
+				{
+					FormatError("[!] Unable to query the protection of {:#x} (err: {})\n", page, HwbpLastError());
+					ReleasePages();
+					return false;
+				}
+
+				it = s_pages.emplace(page, PageRef{ 0, original }).first;
+			}
+
+			it->second.m_refs++;
+			m_pages.push_back({ page, it->second.m_original });
+		}
+
+		m_disabled = false;
+		m_armed.store(true, std::memory_order_release);
+
+		if (ApplyProtection())
+			return true;
+	}
+
+	//
+	// The pages protected before the failure may already be faulting, take them down the
+	// way Disable does, which also drops our references
+	Disable();
+	return false;
+}
+
+void PageWatch::Disable() noexcept
+{
+	if (!m_armed)
+		return;
+
+	m_disabled = true;
+
+	{
+		std::lock_guard lock(s_pageLock);
+		ApplyProtection();
+	}
+
+	//
+	// Inside a handler (ours or another watch's) this thread may itself be stepping over
+	// one of our pages and holds a read section, neither can be waited for. The pages
+	// stay ours, so faults on them are still handled, until a later Disable or the
+	// destructor releases them.
+	if (EpochRegistry<PageWatch>::InReadSection())
+		return;
+
+	//
+	// A thread stepping over one of our pages may close it again with us counted in, let
+	// it finish and redo it. Steps that start from here on see us disabled.
+	WaitForSteps();
+
+	{
+		std::lock_guard lock(s_pageLock);
+		ApplyProtection();
+	}
+
+	m_armed.store(false, std::memory_order_release);
+	s_pageRegistry.Synchronize();
+
+	//
+	// Steps that found us before that still point at us until they close
+	WaitForSteps();
+
+	std::lock_guard lock(s_pageLock);
+	ReleasePages();
+}
+
+void PageWatch::WaitForSteps() const noexcept
+{
+	//
+	// Sequentially consistent with the increment in OpenPage: a step we don't see yet reads
+	// m_disabled after Disable set it, and leaves our protection out
+	while (m_steps.load() != 0 || s_stepping.load() != 0)
+		std::this_thread::yield();
+}
+
+bool PageWatch::Owns(std::uintptr_t page) const noexcept
+{
+	return std::any_of(m_pages.begin(), m_pages.end(), [page](const Page& p) { return p.m_base == page; });
+}
+
+void PageWatch::ReleasePages() noexcept
+{
+	for (const Page& page : m_pages)
+	{
+		auto it = s_pages.find(page.m_base);
+
+		if (it != s_pages.end() && --it->second.m_refs == 0)
+			s_pages.erase(it);
+	}
+
+	m_pages.clear();
+}
+
+bool PageWatch::ApplyProtection() const noexcept
+{
+	bool applied{ true };
+
+	for (const Page& page : m_pages)
+	{
+		if (!PageSetProtection(page.m_base, GuardedProtection(page.m_base, page.m_original)))
+		{
+			FormatError("[!] Unable to protect {:#x} (err: {})\n", page.m_base, HwbpLastError());
+			applied = false;
+		}
+	}
+
+	return applied;
+}
+
+bool PageWatch::Matches(std::uintptr_t address, Access access) const noexcept
+{
+	if (address < m_begin || address >= m_end)
+		return false;
+
+	switch (m_cond)
+	{
+	case BreakpointCondition::Execute:
+		return access == Access::Execute;
+	case BreakpointCondition::Read:
+		//
+		// Same as DR7 type 01, writes only
+		return access == Access::Write;
+	default:
+		return access != Access::Execute;
+	}
+}
+
+std::uint32_t PageWatch::GuardedProtection(std::uintptr_t page, std::uint32_t original) noexcept
+{
+	EpochRegistry<PageWatch>::ReadGuard guard{ s_pageRegistry };
+	std::uint32_t protection = original;
+
+	for (PageWatch* watch : guard)
+	{
+		if (!watch->m_armed.load(std::memory_order_acquire) || watch->m_disabled)
+			continue;
+
+		if (page + PageSize <= watch->m_begin || page >= watch->m_end)
+			continue;
+
+#if defined(HWBP_WINDOWS)
+		//
+		// Any access raises, the handler sorts out which ones count
+		protection = original | PAGE_GUARD;
+#else
+		switch (watch->m_cond)
+		{
+		case BreakpointCondition::Execute:
+			protection &= ~PROT_EXEC;
+			break;
+		case BreakpointCondition::Read:
+			protection &= ~PROT_WRITE;
+			break;
+		default:
+			//
+			// x86 can't take reads away from an executable page
+			protection = PROT_NONE;
+			break;
+		}
+#endif
+	}
+
+	return protection;
+}
+
+bool PageWatch::FindPage(std::uintptr_t page, std::uint32_t& original) noexcept
+{
+	EpochRegistry<PageWatch>::ReadGuard guard{ s_pageRegistry };
+
+	for (PageWatch* watch : guard)
+	{
+		if (!watch->m_armed.load(std::memory_order_acquire))
+			continue;
+
+		for (const Page& p : watch->m_pages)
+		{
+			if (p.m_base == page)
+			{
+				original = p.m_original;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+void PageWatch::OpenPage(std::uintptr_t page, std::uint32_t original) noexcept
+{
+	{
+		EpochRegistry<PageWatch>::ReadGuard guard{ s_pageRegistry };
+
+		for (PageWatch* watch : guard)
+		{
+			if (!watch->m_armed.load(std::memory_order_acquire) || !watch->Owns(page))
+				continue;
+
+			PageWatch** const end = s_step.m_watches + s_step.m_watchCount;
+			if (std::find(s_step.m_watches, end, watch) != end)
+				continue;
+
+			if (s_step.m_watchCount == PendingStep::MaxWatches)
+			{
+				if (!s_step.m_overflow)
+					s_stepping.fetch_add(1);
+
+				s_step.m_overflow = true;
+				continue;
+			}
+
+			//
+			// Ordered against Disable setting m_disabled, see WaitForSteps
+			watch->m_steps.fetch_add(1);
+			s_step.m_watches[s_step.m_watchCount++] = watch;
+		}
+	}
+
+	s_step.m_pages[s_step.m_count] = page;
+	s_step.m_original[s_step.m_count] = original;
+	s_step.m_count++;
+}
+
+void PageWatch::CloseStep() noexcept
+{
+	for (std::uint32_t i = 0; i < s_step.m_count; i++)
+		PageSetProtection(s_step.m_pages[i], GuardedProtection(s_step.m_pages[i], s_step.m_original[i]));
+
+	for (std::uint32_t i = 0; i < s_step.m_watchCount; i++)
+		s_step.m_watches[i]->m_steps.fetch_sub(1, std::memory_order_release);
+
+	if (s_step.m_overflow)
+		s_stepping.fetch_sub(1, std::memory_order_release);
+
+	s_step.m_count = 0;
+	s_step.m_watchCount = 0;
+	s_step.m_overflow = false;
+}
+
+void PageWatch::DispatchAccess(std::uintptr_t address, Access access, HwbpExceptionInfo* exception) noexcept
+{
+#if defined(HWBP_X64)
+	const auto ip = static_cast<std::uintptr_t>(exception->ContextRecord->Rip);
+#else
+	const auto ip = static_cast<std::uintptr_t>(exception->ContextRecord->Eip);
+#endif
+
+	//
+	// An access straddling two watched pages faults on the second one before its step
+	// completes. Watches the first fault already went to have counted the instruction.
+	const bool straddles = s_step.m_count > 1 && s_step.m_ip == ip;
+	const std::uintptr_t first = s_step.m_address;
+
+	if (!straddles)
+	{
+		s_step.m_ip = ip;
+		s_step.m_address = address;
+	}
+
+	s_step.m_inHandler = true;
+
+	{
+		EpochRegistry<PageWatch>::ReadGuard guard{ s_pageRegistry };
+
+		for (PageWatch* watch : guard)
+		{
+			if (!watch->m_armed.load(std::memory_order_acquire) || !watch->Matches(address, access))
+				continue;
+
+			if (straddles && watch->Matches(first, access))
+				continue;
+
+			watch->Dispatch(exception);
+		}
+	}
+
+	s_step.m_inHandler = false;
+}
+
+void PageWatch::Dispatch(HwbpExceptionInfo* exception) noexcept
+{
+#if !defined(HWBP_NO_RUNONCE)
+	//
+	// A runOnce watch stops protecting its pages with its first hit
+	if (m_runOnce ? m_disabled.exchange(true) : m_disabled.load())
+		return;
+#else
+	if (m_disabled.load())
+		return;
+#endif
+
+	m_hits.fetch_add(1, std::memory_order_relaxed);
+
+	if (m_notify)
+		(*m_notify)(exception);
+}
+
+#if defined(HWBP_WINDOWS)
+LONG WINAPI PageWatchExceptionHandler(EXCEPTION_POINTERS* pException)
+{
+	const EXCEPTION_RECORD* record = pException->ExceptionRecord;
+
+	if (record->ExceptionCode == STATUS_GUARD_PAGE_VIOLATION)
+	{
+		const auto address = (std::uintptr_t)record->ExceptionInformation[1];
+		const auto page = address & ~(PageWatch::PageSize - 1);
+		std::uint32_t original{};
+
+		if (s_step.m_count == PendingStep::MaxPages || !PageWatch::FindPage(page, original))
+			return EXCEPTION_CONTINUE_SEARCH;
+
+		//
+		// Raising the exception already took the guard off, the access can be retried as is
+		PageWatch::OpenPage(page, original);
+
+		if (!s_step.m_inHandler)
+		{
+			pException->ContextRecord->EFlags |= TrapFlag;
+
+			const auto access = record->ExceptionInformation[0] == 1 ? PageWatch::Access::Write :
+				record->ExceptionInformation[0] == 8 ? PageWatch::Access::Execute : PageWatch::Access::Read;
+
+			PageWatch::DispatchAccess(address, access, pException);
+		}
+
+		return EXCEPTION_CONTINUE_EXECUTION;
+	}
+
+	//
+	// Only the TF trap we asked for on this thread is ours, a debug register hit arriving
+	// while the step is pending isn't
+	if (record->ExceptionCode == EXCEPTION_SINGLE_STEP && s_step.m_count != 0 && !s_step.m_inHandler &&
+		HwbpDetail::IsStepTrap(pException->ContextRecord->Dr6))
+	{
+		PageWatch::CloseStep();
+		pException->ContextRecord->EFlags &= ~static_cast<DWORD>(TrapFlag);
+
+		//
+		// The step is consumed. A debug register may have fired on the same instruction,
+		// let its handler see it without taking the trap for someone else's.
+		pException->ContextRecord->Dr6 &= ~static_cast<decltype(CONTEXT::Dr6)>(HwbpDetail::Dr6SingleStep);
+
+		if (pException->ContextRecord->Dr6 & HwbpDetail::Dr6Slots)
+			return EXCEPTION_CONTINUE_SEARCH;
+
+		return EXCEPTION_CONTINUE_EXECUTION;
+	}
+
+	return EXCEPTION_CONTINUE_SEARCH;
+}
+#else
+void PageWatchFaultHandler(int sig, siginfo_t* info, void* uctx)
+{
+	auto* uc = static_cast<ucontext_t*>(uctx);
+
+	const auto address = (std::uintptr_t)info->si_addr;
+	const auto page = address & ~(PageWatch::PageSize - 1);
+	std::uint32_t original{};
+
+	if (info->si_code != SEGV_ACCERR || s_step.m_count == PendingStep::MaxPages || !PageWatch::FindPage(page, original))
+		return PageWatchChain(s_oldFault, sig, info, uctx);
+
+	if (!PageSetProtection(page, original))
+		return PageWatchChain(s_oldFault, sig, info, uctx);
+
+	PageWatch::OpenPage(page, original);
+
+	if (s_step.m_inHandler)
+		return;
+
+	uc->uc_mcontext.gregs[REG_EFL] |= TrapFlag;
+
+	//
+	// Page fault error code: bit 1 write, bit 4 instruction fetch
+	const auto error = uc->uc_mcontext.gregs[REG_ERR];
+	const auto access = (error & 0x10) ? PageWatch::Access::Execute :
+		(error & 0x2) ? PageWatch::Access::Write : PageWatch::Access::Read;
+
+	HwbpContext ctx{ uc };
+	HwbpExceptionInfo exception{ info, &ctx };
+
+	PageWatch::DispatchAccess(address, access, &exception);
+}
+
+void PageWatchTrapHandler(int sig, siginfo_t* info, void* uctx)
+{
+	if (info->si_code != TRAP_TRACE || s_step.m_count == 0 || s_step.m_inHandler)
+		return PageWatchChain(s_oldTrap, sig, info, uctx);
+
+	PageWatch::CloseStep();
+	static_cast<ucontext_t*>(uctx)->uc_mcontext.gregs[REG_EFL] &= ~static_cast<greg_t>(TrapFlag);
+}
+#endif
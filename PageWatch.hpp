@@ -0,0 +1,119 @@
+#pragma once
+
+#include "HardwareBreakpoint.hpp"
+
+//
+// Software watchpoint over a range of any size, for targets a debug register can't cover.
+// The pages spanning the range are protected (PAGE_GUARD on Windows, mprotect on Linux),
+// accesses outside the watched range are filtered out in the fault handler, and the
+// faulting instruction is single stepped with its page open before the protection goes
+// back on. Pages are reference counted, so several ranges may share one.
+//
+// Conditions mean the same as for HardwareBreakpoint: Read traps on writes, ReadWrite on
+// any data access and Execute on instruction fetches. Notify handlers run before the
+// access completes, the exception record holds the accessed address
+// (ExceptionInformation[1] on Windows, si_addr on Linux). Hook handlers are not supported.
+//
+// Note: while a thread steps over an access its page is open for every thread. Accesses
+// made by the kernel (read(2) into a watched buffer) fail with EFAULT on Linux instead of
+// being reported. Don't watch pages holding the stack or the handler's own data. On
+// Linux a debug register firing on the stepped instruction may lose its signal to the
+// single step trap (both are SIGTRAP).
+//
+class PageWatch
+{
+#if defined(HWBP_WINDOWS)
+	friend LONG WINAPI PageWatchExceptionHandler(EXCEPTION_POINTERS* pException);
+#else
+	friend void PageWatchFaultHandler(int sig, siginfo_t* info, void* uctx);
+	friend void PageWatchTrapHandler(int sig, siginfo_t* info, void* uctx);
+#endif
+
+public:
+	static constexpr std::uintptr_t PageSize = 0x1000;
+
+	PageWatch(const PageWatch&) = delete;
+	PageWatch(bool runOnce = false);
+	~PageWatch();
+
+	//! Watch `length` bytes at `address`, false with nothing left protected if any page can't be
+	bool Create(void* address, std::size_t length, BreakpointCondition cond, std::optional<BreakpointHandler> handler = std::nullopt) noexcept;
+
+	//! Stop watching and give the pages their protection back. Called from a handler the
+	//! pages are only released by a later call or the destructor.
+	void Disable() noexcept;
+
+	//! Accesses to the watched range since it was created
+	std::uint64_t HitCount() const noexcept
+	{
+		return m_hits.load(std::memory_order_relaxed);
+	}
+
+private:
+	//! Kind of access that faulted
+	enum class Access : std::uint8_t
+	{
+		Read,
+		Write,
+		Execute
+	};
+
+	struct Page
+	{
+		std::uintptr_t	m_base;
+		//! Protection before any watch touched it
+		std::uint32_t	m_original;
+	};
+
+	//! Whether `access` is one our condition traps on
+	bool Matches(std::uintptr_t address, Access access) const noexcept;
+
+	//! Protection a page gets while the remaining live watches cover it
+	static std::uint32_t GuardedProtection(std::uintptr_t page, std::uint32_t original) noexcept;
+
+	//! Original protection of a page owned by a live or dying watch, false if none owns it
+	static bool FindPage(std::uintptr_t page, std::uint32_t& original) noexcept;
+
+	//! Re-apply GuardedProtection to each of our pages, false if any of them failed
+	bool ApplyProtection() const noexcept;
+
+	//! Drop our references on the shared page table
+	void ReleasePages() noexcept;
+
+	//! Whether `page` is one of ours
+	bool Owns(std::uintptr_t page) const noexcept;
+
+	//! Wait until no thread is stepping over one of our pages
+	void WaitForSteps() const noexcept;
+
+	//! Count the hit and run the handler
+	void Dispatch(HwbpExceptionInfo* exception) noexcept;
+
+	//! Note a page the current thread opened until its single step
+	static void OpenPage(std::uintptr_t page, std::uint32_t original) noexcept;
+
+	//! Protect the pages the current thread opened again
+	static void CloseStep() noexcept;
+
+	//! Run every watch the access falls into, once per instruction
+	static void DispatchAccess(std::uintptr_t address, Access access, HwbpExceptionInfo* exception) noexcept;
+
+private:
+	//! Watched range [m_begin, m_end)
+	std::uintptr_t		m_begin{};
+	std::uintptr_t		m_end{};
+	BreakpointCondition	m_cond{};
+	//! Pages spanning the range
+	std::vector<Page>	m_pages;
+	BreakpointHandler	m_handler;
+	//! The Notify_t inside m_handler, if it is a Notify handler
+	const BreakpointHandler::Notify_t* m_notify{};
+	bool				m_runOnce{};
+	//! m_pages may be read by the handlers
+	std::atomic<bool>	m_armed{};
+	//! No dispatch and no longer protecting its pages
+	std::atomic<bool>	m_disabled{ true };
+	//! Threads between a fault on one of our pages and the single step that closes it
+	std::atomic<std::uint32_t> m_steps{};
+	std::atomic<std::uint64_t> m_hits{};
+};
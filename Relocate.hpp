@@ -0,0 +1,167 @@
+#pragma once
+
+//
+// Rewrites single instructions so they can run from a different address (breakpoint
+// instruction buffers, hook trampolines). Relative branches are retargeted and widened
+// when the new displacement does not fit, RIP-relative operands are re-based.
+//
+namespace HwbpDetail
+{
+	//! Largest output RelocateInstruction can produce
+	static constexpr std::size_t MaxRelocatedLength = 32;
+
+	//! Size of the immediate that trails the displacement (excluding relative branches)
+	inline std::size_t ImmediateSize(const hde_t& hde) noexcept
+	{
+		if (hde.flags & F_RELATIVE)
+			return 0;
+		if (hde.flags & F_IMM8)
+			return (hde.flags & F_IMM16) ? 3 : 1; // enter imm16, imm8
+#if defined(HWBP_X64)
+		if (hde.flags & F_IMM64)
+			return 8;
+#endif
+		if (hde.flags & F_IMM32)
+			return 4;
+		if (hde.flags & F_IMM16)
+			return 2;
+		return 0;
+	}
+
+	//! Branch destination of a relative instruction
+	inline std::uintptr_t BranchTarget(const std::uint8_t* src, const hde_t& hde) noexcept
+	{
+		std::intptr_t disp{};
+
+		if (hde.flags & F_IMM8)
+			disp = static_cast<std::int8_t>(hde.imm.imm8);
+		else
+			disp = static_cast<std::int32_t>(hde.imm.imm32);
+
+		return (std::uintptr_t)src + hde.len + disp;
+	}
+
+	//
+	// Call `to` from `at` as if from the original site: the callee returns to `returnTo`
+	// (the instruction after the original call) rather than into the copy, so return
+	// address checks and unwinding still see the original caller. Returns the amount of
+	// bytes written.
+	//
+	inline std::size_t EmitCall(std::uint8_t* out, std::uintptr_t at, std::uintptr_t to, std::uintptr_t returnTo) noexcept
+	{
+		std::size_t len{};
+
+		//
+		// push imm32 (sign extended on x64)
+		out[len++] = 0x68;
+		*(std::uint32_t*)(&out[len]) = static_cast<std::uint32_t>(returnTo);
+		len += sizeof(std::uint32_t);
+
+#if defined(HWBP_X64)
+		//
+		// mov dword ptr [rsp+4], imm32 fills in the upper half, neither touches flags
+		out[len++] = 0xc7;
+		out[len++] = 0x44;
+		out[len++] = 0x24;
+		out[len++] = 0x04;
+		*(std::uint32_t*)(&out[len]) = static_cast<std::uint32_t>(returnTo >> 32);
+		len += sizeof(std::uint32_t);
+#endif
+
+		const auto jmplen = TrampolineArena::EmitJump(&out[len], at + len, to);
+		if (jmplen == 0)
+			return 0;
+
+		return len + jmplen;
+	}
+
+	//
+	// Copy the instruction at `src` into `out`, rewritten to execute from `at`.
+	// Returns the amount of bytes written, or 0 if the instruction can't be moved.
+	//
+	inline std::size_t RelocateInstruction(const std::uint8_t* src, const hde_t& hde, std::uint8_t* out, std::uintptr_t at) noexcept
+	{
+		if (hde.flags & F_ERROR)
+			return 0;
+
+		if (hde.flags & F_RELATIVE)
+		{
+			//
+			// rel16 branches truncate EIP/RIP, nothing sane to do with those
+			if (hde.flags & F_IMM16)
+				return 0;
+
+			const std::uintptr_t target = BranchTarget(src, hde);
+
+			if (hde.opcode == 0xeb || hde.opcode == 0xe9) // jmp
+				return TrampolineArena::EmitJump(out, at, target);
+
+			if (hde.opcode == 0xe8) // call
+				return EmitCall(out, at, target, (std::uintptr_t)src + hde.len);
+
+			//
+			// jcc rel8 (70-7f) or jcc rel32 (0f 80-8f)
+			const bool isJcc = (hde.opcode & 0xf0) == 0x70 || (hde.opcode == 0x0f && (hde.opcode2 & 0xf0) == 0x80);
+
+			if (isJcc)
+			{
+				const std::uint8_t cc = (hde.opcode == 0x0f ? hde.opcode2 : hde.opcode) & 0xf;
+
+				if (TrampolineArena::InRel32(at + 6, target))
+				{
+					out[0] = 0x0f;
+					out[1] = 0x80 | cc;
+					*(std::int32_t*)(&out[2]) = static_cast<std::int32_t>(target - (at + 6));
+					return 6;
+				}
+
+				//
+				// Inverted condition hops over an absolute jump
+				out[0] = 0x70 | (cc ^ 1);
+				const auto jmplen = TrampolineArena::EmitJump(&out[2], at + 2, target);
+				out[1] = static_cast<std::uint8_t>(jmplen);
+				return 2 + jmplen;
+			}
+
+			//
+			// loopnz/loopz/loop/jrcxz (e0-e3) only exist as rel8:
+			//   op +2; jmp short over; jmp target; over:
+			if (hde.opcode >= 0xe0 && hde.opcode <= 0xe3)
+			{
+				std::size_t len{};
+
+				if (hde.p_67)
+					out[len++] = 0x67;
+
+				out[len++] = hde.opcode;
+				out[len++] = 0x02;
+				out[len++] = 0xeb;
+
+				const auto jmplen = TrampolineArena::EmitJump(&out[len + 1], at + len + 1, target);
+				out[len++] = static_cast<std::uint8_t>(jmplen);
+				return len + jmplen;
+			}
+
+			return 0;
+		}
+
+		memcpy(out, src, hde.len);
+
+#if defined(HWBP_X64)
+		//
+		// [rip+disp32] operand, re-base the displacement
+		if ((hde.flags & F_MODRM) && hde.modrm_mod == 0 && hde.modrm_rm == 5)
+		{
+			const std::uintptr_t target = (std::uintptr_t)src + hde.len + static_cast<std::int32_t>(hde.disp.disp32);
+
+			if (!TrampolineArena::InRel32(at + hde.len, target))
+				return 0;
+
+			const std::size_t dispOffset = hde.len - ImmediateSize(hde) - sizeof(std::int32_t);
+			*(std::int32_t*)(&out[dispOffset]) = static_cast<std::int32_t>(target - (at + hde.len));
+		}
+#endif
+
+		return hde.len;
+	}
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <vector>
+
+//
+// Bounded ring the exception handler records samples into, drained in batches by the
+// owner. Producers on different threads only spin against each other for the few
+// instructions a copy takes, a full ring drops the sample instead of waiting.
+//
+template<typename T>
+class SampleRing
+{
+public:
+	explicit SampleRing(std::size_t capacity)
+		: m_slots(std::bit_ceil(std::max<std::size_t>(capacity, 2)))
+	{
+	}
+
+	SampleRing(const SampleRing&) = delete;
+
+	//! Record an item, false if the ring is full
+	bool Push(const T& item) noexcept
+	{
+		Lock();
+
+		const bool full = m_head - m_tail == m_slots.size();
+		if (!full)
+		{
+			m_slots[m_head & (m_slots.size() - 1)] = item;
+			m_head++;
+		}
+
+		Unlock();
+		return !full;
+	}
+
+	//! Move up to `count` of the oldest items into `out`
+	std::size_t Drain(T* out, std::size_t count) noexcept
+	{
+		Lock();
+
+		const std::size_t n = std::min<std::size_t>(count, m_head - m_tail);
+		for (std::size_t i = 0; i < n; i++)
+			out[i] = m_slots[(m_tail + i) & (m_slots.size() - 1)];
+
+		m_tail += n;
+
+		Unlock();
+		return n;
+	}
+
+private:
+	void Lock() noexcept
+	{
+		while (m_lock.test_and_set(std::memory_order_acquire))
+			;
+	}
+
+	void Unlock() noexcept
+	{
+		m_lock.clear(std::memory_order_release);
+	}
+
+private:
+	//! Storage, power of two sized
+	std::vector<T> m_slots;
+	//! Items ever pushed / drained
+	std::size_t m_head{};
+	std::size_t m_tail{};
+	//! Guards all of the above
+	std::atomic_flag m_lock = ATOMIC_FLAG_INIT;
+};
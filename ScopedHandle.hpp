@@ -6,6 +6,8 @@ class ScopedHandle
 
 public:
 	ScopedHandle() = default;
+	ScopedHandle(const ScopedHandle&) = delete;
+	ScopedHandle& operator=(const ScopedHandle&) = delete;
 
 
 	ScopedHandle(HANDLE handle) noexcept
@@ -13,15 +15,37 @@ public:
 	{
 	}
 
+	ScopedHandle(ScopedHandle&& other) noexcept
+		: m_handle(other.m_handle)
+	{
+		other.m_handle = INVALID_HANDLE_VALUE;
+	}
+
+	ScopedHandle& operator=(ScopedHandle&& other) noexcept
+	{
+		if (this != &other)
+		{
+			if (valid())
+				CloseHandle(m_handle);
+
+			m_handle = other.m_handle;
+			other.m_handle = INVALID_HANDLE_VALUE;
+		}
+
+		return *this;
+	}
+
 	~ScopedHandle() noexcept
 	{
 		if (valid())
 			CloseHandle(m_handle);
 	}
 
+	//
+	// Note: OpenThread & co. report failure with NULL rather than INVALID_HANDLE_VALUE
 	bool valid() const noexcept
 	{
-		return m_handle != INVALID_HANDLE_VALUE;
+		return m_handle != INVALID_HANDLE_VALUE && m_handle != nullptr;
 	}
 
 	operator HANDLE () {
@@ -1,6 +1,9 @@
 #pragma once
 
 
+//
+// Handle to a stub in the TrampolineArena
+//
 class ScopedMemory
 {
 	void* m_mem = nullptr;
@@ -8,17 +11,41 @@ class ScopedMemory
 
 public:
 	ScopedMemory() = default;
+	ScopedMemory(const ScopedMemory&) = delete;
+	ScopedMemory& operator=(const ScopedMemory&) = delete;
 
-	ScopedMemory(std::size_t size, std::uint32_t prot) noexcept
-		: m_mem{ VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, prot) }
+	ScopedMemory(std::size_t size, const void* near = nullptr) noexcept
+		: m_mem{ TrampolineArena::Get().Allocate(size, near) }
 		, m_size(size)
 	{
 	}
 
+	ScopedMemory(ScopedMemory&& other) noexcept
+		: m_mem(other.m_mem)
+		, m_size(other.m_size)
+	{
+		other.m_mem = nullptr;
+		other.m_size = 0;
+	}
+
+	ScopedMemory& operator=(ScopedMemory&& other) noexcept
+	{
+		if (this != &other)
+		{
+			reset();
+
+			m_mem = other.m_mem;
+			m_size = other.m_size;
+			other.m_mem = nullptr;
+			other.m_size = 0;
+		}
+
+		return *this;
+	}
+
 	~ScopedMemory() noexcept
 	{
-		if (valid())
-			VirtualFree(m_mem, 0, MEM_RELEASE);
+		reset();
 	}
 
 	bool valid() const noexcept
@@ -31,25 +58,36 @@ public:
 		return m_mem;
 	}
 
-	void setup(std::size_t size, std::uint32_t prot) noexcept
+	//! Allocate `size` bytes, within rel32 reach of `near` if given
+	void setup(std::size_t size, const void* near = nullptr) noexcept
 	{
-		if (valid())
-			VirtualFree(m_mem, 0, MEM_RELEASE);
+		reset();
 
-		m_mem = VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, prot);
+		m_mem = TrampolineArena::Get().Allocate(size, near);
 		m_size = size;
 	}
 
+	void reset() noexcept
+	{
+		if (valid())
+			TrampolineArena::Get().Free(m_mem, m_size);
+
+		m_mem = nullptr;
+		m_size = 0;
+	}
+
+	//
+	// Note: writes stay pending until TrampolineArena::Seal is called
 	void copy(const void* data, std::size_t sz) noexcept
 	{
 		if (valid() && sz <= m_size)
-			memcpy(m_mem, data, sz);
+			TrampolineArena::Get().Write(m_mem, data, sz);
 	}
 
 	void copy(std::size_t idx, const void* data, std::size_t sz) noexcept
 	{
 		if (valid() && (idx + sz) <= m_size && sz <= m_size)
-			memcpy(&((std::uint8_t*)m_mem)[idx], data, sz);
+			TrampolineArena::Get().Write(&((std::uint8_t*)m_mem)[idx], data, sz);
 	}
 
 	std::size_t size() const noexcept
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <mutex>
+#include <unordered_map>
+
+//
+// Threads of this process, with their handles kept open.
+//
+// Seeded from a single toolhelp snapshot the first time it is walked, then kept current by
+// the thread creation hook (OnThreadStart) and a fiber local storage callback that runs
+// when those threads exit. Threads that predate the hook are pruned once their handle
+// becomes signaled. Threads started while the hook was removed are only caught by a new
+// snapshot, so installing the hook again calls Reseed.
+//
+class ThreadRegistry
+{
+public:
+	ThreadRegistry(const ThreadRegistry&) = delete;
+
+	static ThreadRegistry& Get()
+	{
+		static ThreadRegistry s_instance;
+		return s_instance;
+	}
+
+	//! Called on a newly started thread
+	void OnThreadStart()
+	{
+		const DWORD tid = GetCurrentThreadId();
+
+		Add(tid);
+
+		//
+		// Any non-null value gets the callback invoked when this thread exits
+		if (m_flsIndex != FLS_OUT_OF_INDEXES)
+			FlsSetValue(m_flsIndex, reinterpret_cast<PVOID>(static_cast<ULONG_PTR>(tid)));
+	}
+
+	//! Take a new snapshot on the next walk, threads already tracked are kept
+	void Reseed()
+	{
+		std::lock_guard lock(m_lock);
+		m_seeded = false;
+	}
+
+	//! Execute a function for each live thread
+	template<typename TFunc>
+	void ForEach(TFunc f)
+	{
+		std::lock_guard lock(m_lock);
+
+		if (!m_seeded)
+			Seed();
+
+		for (auto it = m_threads.begin(); it != m_threads.end();)
+		{
+			//
+			// Prune threads that exited without going through our callback
+			if (WaitForSingleObject(it->second, 0) == WAIT_OBJECT_0)
+			{
+				it = m_threads.erase(it);
+				continue;
+			}
+
+			f(static_cast<HANDLE>(it->second));
+			++it;
+		}
+	}
+
+private:
+	ThreadRegistry()
+		: m_flsIndex(FlsAlloc(ThreadRegistry::OnThreadExit))
+	{
+	}
+
+	static void NTAPI OnThreadExit(PVOID lpFlsData)
+	{
+		Get().Remove(static_cast<DWORD>(reinterpret_cast<ULONG_PTR>(lpFlsData)));
+	}
+
+	void Add(DWORD tid)
+	{
+		ScopedHandle hThread{ OpenThread(ThreadAccess, FALSE, tid) };
+		if (!hThread.valid())
+			return;
+
+		//
+		// The id may belong to a thread that exited without our callback, its handle goes
+		std::lock_guard lock(m_lock);
+		m_threads.insert_or_assign(tid, std::move(hThread));
+	}
+
+	void Remove(DWORD tid)
+	{
+		std::lock_guard lock(m_lock);
+		m_threads.erase(tid);
+	}
+
+	//! Whether `tid` has a live handle, a signaled one belongs to an earlier thread with that id
+	bool Tracked(DWORD tid)
+	{
+		auto it = m_threads.find(tid);
+		return it != m_threads.end() && WaitForSingleObject(it->second, 0) != WAIT_OBJECT_0;
+	}
+
+	void Seed()
+	{
+		ScopedHandle hSnapshot{ CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0) };
+		if (!hSnapshot.valid())
+			return;
+
+		const DWORD pid = GetCurrentProcessId();
+
+		THREADENTRY32 te32{};
+		te32.dwSize = sizeof(te32);
+
+		if (Thread32First(hSnapshot, &te32))
+		{
+			do
+			{
+				if (te32.th32OwnerProcessID == pid && !Tracked(te32.th32ThreadID))
+				{
+					ScopedHandle hThread{ OpenThread(ThreadAccess, FALSE, te32.th32ThreadID) };
+					if (hThread.valid())
+						m_threads.insert_or_assign(te32.th32ThreadID, std::move(hThread));
+				}
+			} while (Thread32Next(hSnapshot, &te32));
+		}
+
+		m_seeded = true;
+	}
+
+private:
+	static constexpr DWORD ThreadAccess =
+		THREAD_GET_CONTEXT | THREAD_SET_CONTEXT | THREAD_SUSPEND_RESUME | THREAD_QUERY_LIMITED_INFORMATION | SYNCHRONIZE;
+
+	//! Thread id -> open handle
+	std::unordered_map<DWORD, ScopedHandle> m_threads;
+	//! Guards m_threads
+	std::mutex m_lock;
+	//! Whether a snapshot was taken since the last Reseed
+	bool m_seeded{};
+	//! FLS slot used for exit notification
+	DWORD m_flsIndex{ FLS_OUT_OF_INDEXES };
+};
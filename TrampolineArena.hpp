@@ -0,0 +1,491 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <mutex>
+
+//
+// Packs small executable stubs (breakpoint resume buffers, hook trampolines) into shared
+// 64 KB regions instead of giving each its own VirtualAlloc (or mmap on Linux).
+//
+// Every region is mapped twice from the same memory: an execute/read view the stubs run
+// from, placed within rel32 reach of the code they belong to on x64 so stubs can use 5
+// byte jumps, and a read/write view anywhere that Write goes through. No page is ever
+// writable and executable at once, and writing a stub never changes the protection of the
+// others in the region, which may be running. Seal() flushes the instruction cache once
+// per batch.
+//
+// Freed stubs are only retired: a thread may have just been sent into one by the exception
+// handler, or still be running it. Their slots are reused once the owner has waited out a
+// grace period and calls Reclaim.
+//
+class TrampolineArena
+{
+public:
+	static constexpr std::size_t RegionSize = 0x10000;
+	static constexpr std::size_t SlotSize = 32;
+	static constexpr std::size_t SlotCount = RegionSize / SlotSize;
+
+#if defined(HWBP_X64)
+	static constexpr std::size_t MaxJumpLength = 14;
+	//! Keep some slack so every byte of a region is reachable from the target
+	static constexpr std::uintptr_t MaxDistance = 0x7ff00000;
+#else
+	static constexpr std::size_t MaxJumpLength = 5;
+#endif
+
+	TrampolineArena(const TrampolineArena&) = delete;
+
+	static TrampolineArena& Get()
+	{
+		//
+		// Never destroyed: static destructors (hook maps, global breakpoints) free their stubs
+		// into it in any order, and threads may run its stubs until the process is gone
+		static TrampolineArena* s_instance = new TrampolineArena();
+		return *s_instance;
+	}
+
+	//! Whether a rel32 displacement from `from` can reach `to`
+	static bool InRel32(std::uintptr_t from, std::uintptr_t to) noexcept
+	{
+#if defined(HWBP_X64)
+		const auto delta = static_cast<std::intptr_t>(to - from);
+		return delta >= INT32_MIN && delta <= INT32_MAX;
+#else
+		return true;
+#endif
+	}
+
+	//! Assemble a jmp located at `at` to `to`, returns the amount of bytes written
+	static std::size_t EmitJump(std::uint8_t* out, std::uintptr_t at, std::uintptr_t to) noexcept
+	{
+		if (InRel32(at + 5, to))
+		{
+			out[0] = 0xe9;
+			*(std::int32_t*)(&out[1]) = static_cast<std::int32_t>(to - (at + 5));
+			return 5;
+		}
+
+#if defined(HWBP_X64)
+		//
+		// jmp qword ptr [rip+0] followed by the destination, doesn't clobber any register
+		out[0] = 0xff;
+		out[1] = 0x25;
+		*(std::uint32_t*)(&out[2]) = 0;
+		*(std::uint64_t*)(&out[6]) = to;
+		return 14;
+#else
+		return 0;
+#endif
+	}
+
+	//! Reserve executable memory, within rel32 reach of `near` if given
+	void* Allocate(std::size_t size, const void* near = nullptr)
+	{
+		if (size == 0 || size > RegionSize)
+			return nullptr;
+
+		const std::size_t slots = (size + SlotSize - 1) / SlotSize;
+
+		std::lock_guard lock(m_lock);
+
+		for (auto& region : m_regions)
+		{
+			if (region->m_freeSlots < slots || !Reachable(region->m_base, near))
+				continue;
+
+			if (void* p = region->Take(slots))
+				return p;
+		}
+
+		auto region = std::make_unique<Region>();
+		if (!AllocateRegion(*region, near))
+			return nullptr;
+
+		void* p = region->Take(slots);
+		m_regions.push_back(std::move(region));
+		return p;
+	}
+
+	//! Retire a stub, its slots stay taken until Reclaim
+	void Free(void* p, std::size_t size) noexcept
+	{
+		if (!p)
+			return;
+
+		std::lock_guard lock(m_lock);
+
+		m_retired.push_back({ (std::uint8_t*)p, (size + SlotSize - 1) / SlotSize, m_retireCount++ });
+	}
+
+	//! Stubs retired so far, what a Reclaim after the next grace period may hand back
+	std::uint64_t RetireMark() noexcept
+	{
+		std::lock_guard lock(m_lock);
+		return m_retireCount;
+	}
+
+	//! Whether any stub waits for a grace period
+	bool HasRetired() noexcept
+	{
+		std::lock_guard lock(m_lock);
+		return !m_retired.empty();
+	}
+
+	//! Reuse the stubs retired before `mark`, nothing may enter or run them anymore
+	void Reclaim(std::uint64_t mark) noexcept
+	{
+		std::lock_guard lock(m_lock);
+
+		std::erase_if(m_retired, [this, mark](const Retired& retired)
+			{
+				if (retired.m_sequence >= mark)
+					return false;
+
+				if (Region* region = Find(retired.m_stub))
+					region->Release(retired.m_stub, retired.m_slots);
+
+				return true;
+			});
+	}
+
+	//! Copy into a stub through the writable view, executed after the next Seal
+	bool Write(void* dst, const void* src, std::size_t size) noexcept
+	{
+		std::lock_guard lock(m_lock);
+
+		Region* region = Find(dst);
+		if (!region)
+			return false;
+
+		memcpy(region->m_write + ((std::uint8_t*)dst - region->m_base), src, size);
+		region->m_written = true;
+		return true;
+	}
+
+	//! Make everything written since the last call visible to the executable views
+	void Seal() noexcept
+	{
+		std::lock_guard lock(m_lock);
+
+		for (auto& region : m_regions)
+		{
+			if (!region->m_written)
+				continue;
+
+#if defined(HWBP_WINDOWS)
+			FlushInstructionCache(GetCurrentProcess(), region->m_base, RegionSize);
+#else
+			__builtin___clear_cache((char*)region->m_base, (char*)region->m_base + RegionSize);
+#endif
+
+			region->m_written = false;
+		}
+	}
+
+private:
+	struct Region
+	{
+		//! Execute/read view, what stubs are addressed by
+		std::uint8_t* m_base{};
+		//! Read/write view of the same memory
+		std::uint8_t* m_write{};
+		std::array<std::uint64_t, SlotCount / 64> m_used{};
+		std::size_t m_freeSlots{ SlotCount };
+		//! Written since the last Seal
+		bool m_written{};
+
+		bool IsUsed(std::size_t slot) const noexcept
+		{
+			return (m_used[slot / 64] >> (slot % 64)) & 1;
+		}
+
+		void Mark(std::size_t slot, std::size_t count, bool used) noexcept
+		{
+			for (std::size_t i = slot; i < slot + count; i++)
+			{
+				if (used)
+					m_used[i / 64] |= std::uint64_t{ 1 } << (i % 64);
+				else
+					m_used[i / 64] &= ~(std::uint64_t{ 1 } << (i % 64));
+			}
+		}
+
+		void* Take(std::size_t count) noexcept
+		{
+			std::size_t run{};
+
+			for (std::size_t i = 0; i < SlotCount; i++)
+			{
+				run = IsUsed(i) ? 0 : run + 1;
+
+				if (run == count)
+				{
+					const std::size_t first = i + 1 - count;
+					Mark(first, count, true);
+					m_freeSlots -= count;
+					return m_base + first * SlotSize;
+				}
+			}
+
+			return nullptr;
+		}
+
+		void Release(std::uint8_t* p, std::size_t count) noexcept
+		{
+			Mark((p - m_base) / SlotSize, count, false);
+			m_freeSlots += count;
+		}
+	};
+
+	struct Retired
+	{
+		std::uint8_t*	m_stub;
+		std::size_t		m_slots;
+		//! Order of retirement, compared against RetireMark
+		std::uint64_t	m_sequence;
+	};
+
+	TrampolineArena() = default;
+
+	Region* Find(const void* p) noexcept
+	{
+		for (auto& region : m_regions)
+		{
+			if ((const std::uint8_t*)p >= region->m_base && (const std::uint8_t*)p < region->m_base + RegionSize)
+				return region.get();
+		}
+
+		return nullptr;
+	}
+
+	static bool Reachable(const void* base, const void* near) noexcept
+	{
+#if defined(HWBP_X64)
+		if (!near)
+			return true;
+
+		const auto lo = (std::uintptr_t)base;
+		const auto hi = lo + RegionSize;
+		const auto target = (std::uintptr_t)near;
+
+		return (target > lo ? target - lo : lo - target) <= MaxDistance &&
+			(target > hi ? target - hi : hi - target) <= MaxDistance;
+#else
+		return true;
+#endif
+	}
+
+#if defined(HWBP_WINDOWS)
+	//! Map both views of a new pagefile backed section
+	static bool AllocateRegion(Region& region, const void* near) noexcept
+	{
+		HANDLE section = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_EXECUTE_READWRITE | SEC_COMMIT, 0, RegionSize, nullptr);
+		if (!section)
+			return false;
+
+		region.m_base = (std::uint8_t*)PlaceRegion(section, near);
+
+		if (region.m_base)
+		{
+			region.m_write = (std::uint8_t*)MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, RegionSize);
+
+			if (!region.m_write)
+			{
+				UnmapViewOfFile(region.m_base);
+				region.m_base = nullptr;
+			}
+		}
+
+		//
+		// The views keep the section alive
+		CloseHandle(section);
+		return region.m_base != nullptr;
+	}
+
+	//! Map the executable view of `section` at `at` (anywhere if null)
+	static void* MapExecutable(HANDLE section, void* at) noexcept
+	{
+		return MapViewOfFileEx(section, FILE_MAP_READ | FILE_MAP_EXECUTE, 0, 0, RegionSize, at);
+	}
+
+	static void* PlaceRegion(HANDLE section, const void* near) noexcept
+	{
+#if defined(HWBP_X64)
+		if (near)
+		{
+			SYSTEM_INFO si{};
+			GetSystemInfo(&si);
+
+			const auto target = (std::uintptr_t)near & ~(RegionSize - 1);
+			const auto minAddr = std::max<std::uintptr_t>((std::uintptr_t)si.lpMinimumApplicationAddress,
+				target > MaxDistance ? target - MaxDistance : 0);
+			const auto maxAddr = std::min<std::uintptr_t>((std::uintptr_t)si.lpMaximumApplicationAddress,
+				target + MaxDistance);
+
+			//
+			// Walk the address space outward from the target, skipping whole allocations at a time
+			std::uintptr_t below = target, above = target;
+
+			while (below > minAddr || above < maxAddr)
+			{
+				if (below >= minAddr + RegionSize)
+				{
+					below -= RegionSize;
+
+					MEMORY_BASIC_INFORMATION mbi{};
+					if (!VirtualQuery((void*)below, &mbi, sizeof(mbi)))
+						below = minAddr;
+					else if (mbi.State == MEM_FREE)
+					{
+						if (void* p = MapExecutable(section, (void*)below))
+							return p;
+					}
+					else
+						below = (std::uintptr_t)mbi.AllocationBase & ~(RegionSize - 1);
+				}
+				else
+					below = minAddr;
+
+				if (above + 2 * RegionSize <= maxAddr)
+				{
+					above += RegionSize;
+
+					MEMORY_BASIC_INFORMATION mbi{};
+					if (!VirtualQuery((void*)above, &mbi, sizeof(mbi)))
+						above = maxAddr;
+					else if (mbi.State == MEM_FREE)
+					{
+						if (void* p = MapExecutable(section, (void*)above))
+							return p;
+					}
+					else
+						above = ((std::uintptr_t)mbi.BaseAddress + mbi.RegionSize - 1) & ~(RegionSize - 1);
+				}
+				else
+					above = maxAddr;
+			}
+
+			return nullptr;
+		}
+#endif
+
+		return MapExecutable(section, nullptr);
+	}
+#else
+	//! Map both views of a new memfd
+	static bool AllocateRegion(Region& region, const void* near) noexcept
+	{
+		const int fd = memfd_create("hwbp-arena", MFD_CLOEXEC);
+		if (fd == -1)
+			return false;
+
+		if (ftruncate(fd, RegionSize) == 0)
+			region.m_base = (std::uint8_t*)PlaceRegion(fd, near);
+
+		if (region.m_base)
+		{
+			region.m_write = (std::uint8_t*)MapView(fd, nullptr, PROT_READ | PROT_WRITE, 0);
+
+			if (!region.m_write)
+			{
+				munmap(region.m_base, RegionSize);
+				region.m_base = nullptr;
+			}
+		}
+
+		//
+		// The views keep the memory alive
+		close(fd);
+		return region.m_base != nullptr;
+	}
+
+	static void* MapView(int fd, void* at, int prot, int flags) noexcept
+	{
+		void* p = mmap(at, RegionSize, prot, MAP_SHARED | flags, fd, 0);
+		return p == MAP_FAILED ? nullptr : p;
+	}
+
+	static void* PlaceRegion(int fd, const void* near) noexcept
+	{
+#if defined(HWBP_X64)
+		if (near)
+		{
+			//
+			// There is no VirtualQuery, so take the holes between the mappings listed in
+			// /proc/self/maps and try the closest aligned address in each, nearest first
+			FILE* maps = fopen("/proc/self/maps", "r");
+			if (!maps)
+				return nullptr;
+
+			const auto target = (std::uintptr_t)near & ~(RegionSize - 1);
+			std::vector<std::uintptr_t> candidates;
+
+			std::uintptr_t holeStart = MinAddress;
+			unsigned long lo{}, hi{};
+			char line[512];
+
+			while (fgets(line, sizeof(line), maps))
+			{
+				if (sscanf(line, "%lx-%lx", &lo, &hi) != 2)
+					continue;
+
+				AddCandidate(candidates, target, holeStart, lo);
+				holeStart = std::max<std::uintptr_t>(holeStart, hi);
+			}
+
+			fclose(maps);
+			AddCandidate(candidates, target, holeStart, MaxAddress);
+
+			std::sort(candidates.begin(), candidates.end(), [target](std::uintptr_t a, std::uintptr_t b)
+				{
+					return (a > target ? a - target : target - a) < (b > target ? b - target : target - b);
+				});
+
+			for (std::uintptr_t candidate : candidates)
+			{
+				//
+				// Another thread may have mapped the hole since, never clobber it
+				if (void* p = MapView(fd, (void*)candidate, PROT_READ | PROT_EXEC, MAP_FIXED_NOREPLACE))
+					return p;
+			}
+
+			return nullptr;
+		}
+#endif
+
+		return MapView(fd, nullptr, PROT_READ | PROT_EXEC, 0);
+	}
+
+#if defined(HWBP_X64)
+	//! Record the aligned address of the hole [start, end) closest to target, if in reach
+	static void AddCandidate(std::vector<std::uintptr_t>& candidates, std::uintptr_t target, std::uintptr_t start, std::uintptr_t end)
+	{
+		start = (start + RegionSize - 1) & ~(RegionSize - 1);
+		end &= ~(RegionSize - 1);
+
+		if (start >= end || end - start < RegionSize)
+			return;
+
+		const std::uintptr_t at = std::clamp(target, start, end - RegionSize);
+
+		if (Reachable((void*)at, (void*)target))
+			candidates.push_back(at);
+	}
+
+	//! Lowest address mmap hands out by default (vm.mmap_min_addr)
+	static constexpr std::uintptr_t MinAddress = 0x10000;
+	//! Top of the user address space with 4 level paging
+	static constexpr std::uintptr_t MaxAddress = 0x7ffffffff000;
+#endif
+#endif
+
+private:
+	//! Every region handed out so far
+	std::vector<std::unique_ptr<Region>> m_regions;
+	//! Freed stubs waiting for a grace period
+	std::vector<Retired> m_retired;
+	std::uint64_t m_retireCount{};
+	//! Guards m_regions and m_retired
+	std::mutex m_lock;
+};
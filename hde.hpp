@@ -9,6 +9,14 @@ inline auto hde_disasm(void* p, hde_t* hde) {
 	return hde32_disasm(p, hde);
 }
 
+inline auto hde_length(const void* p) {
+	return hde32_length(p);
+}
+
+inline auto hde_length_cover(const void* p, unsigned int size) {
+	return hde32_length_cover(p, size);
+}
+
 #else
 #include "hde/hde64/include/hde64.h"
 
@@ -18,4 +26,12 @@ inline auto hde_disasm(void* p, hde_t* hde) {
 	return hde64_disasm(p, hde);
 }
 
+inline auto hde_length(const void* p) {
+	return hde64_length(p);
+}
+
+inline auto hde_length_cover(const void* p, unsigned int size) {
+	return hde64_length_cover(p, size);
+}
+
 #endif
\ No newline at end of file
@@ -34,7 +34,8 @@
 #define F_PREFIX_67     0x08000000
 #define F_PREFIX_LOCK   0x10000000
 #define F_PREFIX_SEG    0x20000000
-#define F_PREFIX_ANY    0x3f000000
+#define F_PREFIX_VEX    0x40000000
+#define F_PREFIX_ANY    0x7f000000
 
 #define PREFIX_SEGMENT_CS   0x2e
 #define PREFIX_SEGMENT_SS   0x36
@@ -78,6 +79,12 @@ typedef struct {
 		uint32_t disp32;
 	} disp;
 	uint32_t flags;
+	uint8_t opcode3;	/* 0f 38 / 0f 3a opcodes, opcode2 holds 38 or 3a */
+	uint8_t vex_map;	/* F_PREFIX_VEX: opcode holds c4/c5/62/8f, opcode2 the opcode in this map */
+	uint8_t vex_w;
+	uint8_t vex_l;		/* evex: L'L */
+	uint8_t vex_pp;
+	uint8_t vex_vvvv;
 } hde32s;
 
 #pragma pack(pop)
@@ -89,6 +96,12 @@ extern "C" {
 /* __cdecl */
 unsigned int hde32_disasm(const void *code, hde32s *hs);
 
+/* length of the instruction at code, same result as hde32_disasm */
+unsigned int hde32_length(const void *code);
+
+/* bytes needed to cover at least size bytes with whole instructions */
+unsigned int hde32_length_cover(const void *code, unsigned int size);
+
 #ifdef __cplusplus
 }
 #endif
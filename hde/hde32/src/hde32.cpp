@@ -14,10 +14,48 @@
 #pragma warning(disable:4701)
 #endif
 
+/*
+ * vex (c4/c5), evex (62) or xop (8f with a map above 7), p points past c.
+ * Outside of long mode c4/c5/62 are only prefixes when followed by a
+ * register-only modrm, otherwise they are les/lds/bound.
+ */
+#define IS_VEX(c, p) ((((c) == 0xc4 || (c) == 0xc5 || (c) == 0x62) && *(p) >= 0xc0) || ((c) == 0x8f && (*(p) & 0x1f) >= 8))
+
+/*
+ * Operand flags of an opcode in a vex/evex/xop map, C_ERROR if the map
+ * doesn't exist for that encoding. Everything but vzeroupper/vzeroall
+ * takes a modrm, the immediate depends on the map.
+ */
+static inline uint8_t hde32_vex_cflags(uint8_t escape, uint8_t map, uint8_t opcode)
+{
+	switch (map) {
+	case 1:
+		if (opcode == 0x77)
+			return escape == 0x62 ? C_ERROR : C_NONE;
+		if ((opcode >= 0x70 && opcode <= 0x73) || opcode == 0xc2 || (opcode >= 0xc4 && opcode <= 0xc6))
+			return C_MODRM | C_IMM8;
+		return C_MODRM;
+	case 2:
+		return C_MODRM;
+	case 3:
+		return C_MODRM | C_IMM8;
+	case 5: case 6:
+		return escape == 0x62 ? C_MODRM : C_ERROR;
+	case 8:
+		return escape == 0x8f ? C_MODRM | C_IMM8 : C_ERROR;
+	case 9:
+		return escape == 0x8f ? C_MODRM : C_ERROR;
+	case 10:
+		return escape == 0x8f ? C_MODRM | C_IMM_P66 : C_ERROR;
+	}
+	return C_ERROR;
+}
+
 unsigned int hde32_disasm(const void *code, hde32s *hs)
 {
 	uint8_t x, c, *p = (uint8_t*)code, cflags, opcode, pref = 0;
 	uint8_t* ht = hde32_table, m_mod, m_reg, m_rm, disp_size = 0;
+	uint8_t ext = 0;
 
 	memset(hs,0,sizeof(hde32s));
 
@@ -58,9 +96,45 @@ pref_done:
 	if (!pref)
 		pref |= PRE_NONE;
 
+	if (IS_VEX(c, p)) {
+		/* the vex prefix encodes 66/f2/f3 itself */
+		if (pref & (PRE_66 | PRE_F2 | PRE_F3 | PRE_LOCK))
+			hs->flags |= F_ERROR | F_ERROR_OPCODE;
+		pref &= ~PRE_66;
+
+		hs->flags |= F_PREFIX_VEX;
+		hs->opcode = c;
+		if (c == 0xc5)
+			hs->vex_map = 1;
+		else {
+			hs->vex_map = *p++ & (c == 0x62 ? 0x07 : 0x1f);
+			hs->vex_w = *p >> 7;
+		}
+		hs->vex_vvvv = (~*p >> 3) & 0xf;
+		hs->vex_l = (*p >> 2) & 1;
+		hs->vex_pp = *p++ & 3;
+		if (c == 0x62)
+			hs->vex_l = (*p++ >> 5) & 3;
+
+		hs->opcode2 = opcode = c = *p++;
+		if ((cflags = hde32_vex_cflags(hs->opcode, hs->vex_map, opcode)) == C_ERROR) {
+			hs->flags |= F_ERROR | F_ERROR_OPCODE;
+			cflags = C_MODRM;
+		}
+		ext++;
+		goto opcode_done;
+	}
+
 	if ((hs->opcode = c) == 0x0f) {
 		hs->opcode2 = c = *p++;
 		ht += DELTA_OPCODES;
+		if (c == 0x38 || c == 0x3a) {
+			/* every three byte opcode has a modrm, 0f 3a ones an imm8 as well */
+			hs->opcode3 = opcode = *p++;
+			cflags = c == 0x38 ? C_MODRM : C_MODRM | C_IMM8;
+			ext++;
+			goto opcode_done;
+		}
 	} else if (c >= 0xa0 && c <= 0xa3) {
 		if (pref & PRE_67)
 			pref |= PRE_66;
@@ -92,6 +166,8 @@ pref_done:
 			hs->flags |= F_ERROR | F_ERROR_OPCODE;
 	}
 
+opcode_done:
+
 	if (cflags & C_MODRM) {
 		hs->flags |= F_MODRM;
 		hs->modrm = c = *p++;
@@ -99,6 +175,13 @@ pref_done:
 		hs->modrm_rm = m_rm = c & 7;
 		hs->modrm_reg = m_reg = (c & 0x3f) >> 3;
 
+		/* the tables below only cover the one and two byte maps */
+		if (ext) {
+			if (pref & PRE_LOCK)
+				hs->flags |= F_ERROR | F_ERROR_LOCK;
+			goto no_error_operand;
+		}
+
 		if (x && ((x << m_reg) & 0x80))
 			hs->flags |= F_ERROR | F_ERROR_OPCODE;
 
@@ -211,9 +294,9 @@ no_error_operand:
 
 		c = *p++;
 		if (m_reg <= 1) {
-			if (opcode == 0xf6)
+			if (hs->opcode == 0xf6)
 				cflags |= C_IMM8;
-			else if (opcode == 0xf7)
+			else if (hs->opcode == 0xf7)
 				cflags |= C_IMM_P66;
 		}
 
@@ -323,3 +406,154 @@ disasm_done:
 
 	return (unsigned int)hs->len;
 }
+
+/*
+ * Length-only variant of hde32_disasm: same tables and the same result as
+ * hde32_disasm(code, &hs) returns, but no hde32s is filled and none of the
+ * validity checks (lock, fpu, operand) are performed.
+ */
+unsigned int hde32_length(const void *code)
+{
+	uint8_t x, c, *p = (uint8_t*)code, cflags, opcode, pref = 0;
+	uint8_t *ht = hde32_table, m_mod, m_rm, m_reg, disp_size = 0;
+	uint8_t opcode2 = 0, ext = 0;
+	unsigned int len;
+
+	for (x = 16; x; x--) {
+		switch (c = *p++) {
+		case 0xf3: case 0xf2: case 0xf0:
+		case 0x26: case 0x2e: case 0x36:
+		case 0x3e: case 0x64: case 0x65:
+			continue;
+		case 0x66:
+			pref |= PRE_66;
+			continue;
+		case 0x67:
+			pref |= PRE_67;
+			continue;
+		}
+		break;
+	}
+
+	if (IS_VEX(c, p)) {
+		uint8_t map = 1;
+
+		pref &= ~PRE_66;
+		if (c != 0xc5)
+			map = *p++ & (c == 0x62 ? 0x07 : 0x1f);
+		p += c == 0x62 ? 2 : 1;
+
+		opcode2 = opcode = *p++;
+		if ((cflags = hde32_vex_cflags(c, map, opcode)) == C_ERROR)
+			cflags = C_MODRM;
+		ext++;
+		goto opcode_done;
+	}
+
+	if (c == 0x0f) {
+		opcode2 = c = *p++;
+		ht += DELTA_OPCODES;
+		if (c == 0x38 || c == 0x3a) {
+			opcode = *p++;
+			cflags = c == 0x38 ? C_MODRM : C_MODRM | C_IMM8;
+			ext++;
+			goto opcode_done;
+		}
+	} else if (c >= 0xa0 && c <= 0xa3) {
+		if (pref & PRE_67)
+			pref |= PRE_66;
+		else
+			pref &= ~PRE_66;
+	}
+
+	opcode = c;
+	cflags = ht[ht[opcode / 4] + (opcode % 4)];
+
+	if (cflags == C_ERROR)
+		cflags = (opcode & -3) == 0x24 ? C_MODRM : 0;
+
+	if (cflags & C_GROUP)
+		cflags = (uint8_t)*(uint16_t*)(ht + (cflags & 0x7f));
+
+opcode_done:
+
+	if (cflags & C_MODRM) {
+		c = *p++;
+		m_mod = c >> 6;
+		m_rm = c & 7;
+		m_reg = (c & 0x3f) >> 3;
+
+		/* mov cr/dr always address a register */
+		if (opcode2 && !ext && opcode >= 0x20 && opcode <= 0x23)
+			m_mod = 3;
+
+		if (m_reg <= 1 && !opcode2) {
+			if (opcode == 0xf6)
+				cflags |= C_IMM8;
+			else if (opcode == 0xf7)
+				cflags |= C_IMM_P66;
+		}
+
+		switch (m_mod) {
+		case 0:
+			if (pref & PRE_67) {
+				if (m_rm == 6)
+					disp_size = 2;
+			} else
+				if (m_rm == 5)
+					disp_size = 4;
+			break;
+		case 1:
+			disp_size = 1;
+			break;
+		case 2:
+			disp_size = 2;
+			if (!(pref & PRE_67))
+				disp_size <<= 1;
+			break;
+		}
+
+		if (m_mod != 3 && m_rm == 4 && !(pref & PRE_67)) {
+			if ((*p++ & 7) == 5 && !(m_mod & 1))
+				disp_size = 4;
+		}
+
+		p += disp_size;
+	}
+
+	if (cflags & C_IMM_P66) {
+		if (cflags & C_REL32) {
+			p += (pref & PRE_66) ? 2 : 4;
+			goto length_done;
+		}
+		p += (pref & PRE_66) ? 2 : 4;
+	}
+
+	if (cflags & C_IMM16)
+		p += 2;
+	if (cflags & C_IMM8)
+		p++;
+
+	if (cflags & C_REL32)
+		p += 4;
+	else if (cflags & C_REL8)
+		p++;
+
+length_done:
+
+	if ((len = (unsigned int)(p - (uint8_t*)code)) > 15)
+		len = 15;
+
+	return len;
+}
+
+unsigned int hde32_length_cover(const void *code, unsigned int size)
+{
+	const uint8_t *p = (const uint8_t*)code;
+	unsigned int total = 0;
+
+	while (total < size)
+		total += hde32_length(p + total);
+
+	return total;
+}
@@ -11,6 +11,7 @@
 #define _HDE64_H_
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define F_MODRM         0x00000001
 #define F_SIB           0x00000002
@@ -35,7 +36,8 @@
 #define F_PREFIX_LOCK   0x10000000
 #define F_PREFIX_SEG    0x20000000
 #define F_PREFIX_REX    0x40000000
-#define F_PREFIX_ANY    0x7f000000
+#define F_PREFIX_VEX    0x80000000
+#define F_PREFIX_ANY    0xff000000
 
 #define PREFIX_SEGMENT_CS   0x2e
 #define PREFIX_SEGMENT_SS   0x36
@@ -85,10 +87,31 @@ typedef struct {
 		uint32_t disp32;
 	} disp;
 	uint32_t flags;
+	uint8_t opcode3;	/* 0f 38 / 0f 3a opcodes, opcode2 holds 38 or 3a */
+	uint8_t vex_map;	/* F_PREFIX_VEX: opcode holds c4/c5/62/8f, opcode2 the opcode in this map */
+	uint8_t vex_w;
+	uint8_t vex_l;		/* evex: L'L */
+	uint8_t vex_pp;
+	uint8_t vex_vvvv;
 } hde64s;
 
 #pragma pack(pop)
 
+/*
+ * Structure-of-arrays output for hde64_disasm_batch. Any array may be NULL
+ * to skip that column, the others must hold at least capacity entries.
+ */
+typedef struct {
+	uint32_t *offset;	/* offset of the instruction from code */
+	uint8_t  *len;
+	uint8_t  *opcode;	/* 0x0f for two byte opcodes */
+	uint8_t  *opcode2;
+	uint32_t *flags;	/* F_MODRM, F_SIB, F_IMM*, F_DISP*, F_RELATIVE, F_ERROR*, F_PREFIX_66/67/REX */
+	uint64_t *target;	/* branch destination at base if F_RELATIVE, otherwise 0 */
+	uint32_t capacity;
+	uint32_t count;		/* set by hde64_disasm_batch */
+} hde64_batch;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -96,6 +119,19 @@ extern "C" {
 /* __cdecl */
 unsigned int hde64_disasm(const void *code, hde64s *hs);
 
+/* length of the instruction at code, same result as hde64_disasm */
+unsigned int hde64_length(const void *code);
+
+/* bytes needed to cover at least size bytes with whole instructions */
+unsigned int hde64_length_cover(const void *code, unsigned int size);
+
+/*
+ * Decode consecutive instructions of a code region into batch, base is the
+ * address code is loaded at. Stops at the end of the region, at capacity or
+ * at an instruction that runs past the end. Returns the bytes consumed.
+ */
+size_t hde64_disasm_batch(const void *code, size_t size, uint64_t base, hde64_batch *batch);
+
 #ifdef __cplusplus
 }
 #endif
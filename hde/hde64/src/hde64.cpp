@@ -12,11 +12,44 @@
 
 #pragma warning(disable:4701 4706)
 
+/* vex (c4/c5), evex (62) or xop (8f with a map above 7), p points past c */
+#define IS_VEX(c, p) ((c) == 0xc4 || (c) == 0xc5 || (c) == 0x62 || ((c) == 0x8f && (*(p) & 0x1f) >= 8))
+
+/*
+ * Operand flags of an opcode in a vex/evex/xop map, C_ERROR if the map
+ * doesn't exist for that encoding. Everything but vzeroupper/vzeroall
+ * takes a modrm, the immediate depends on the map.
+ */
+static inline uint8_t hde64_vex_cflags(uint8_t escape, uint8_t map, uint8_t opcode)
+{
+	switch (map) {
+	case 1:
+		if (opcode == 0x77)
+			return escape == 0x62 ? C_ERROR : C_NONE;
+		if ((opcode >= 0x70 && opcode <= 0x73) || opcode == 0xc2 || (opcode >= 0xc4 && opcode <= 0xc6))
+			return C_MODRM | C_IMM8;
+		return C_MODRM;
+	case 2:
+		return C_MODRM;
+	case 3:
+		return C_MODRM | C_IMM8;
+	case 5: case 6:
+		return escape == 0x62 ? C_MODRM : C_ERROR;
+	case 8:
+		return escape == 0x8f ? C_MODRM | C_IMM8 : C_ERROR;
+	case 9:
+		return escape == 0x8f ? C_MODRM : C_ERROR;
+	case 10:
+		return escape == 0x8f ? C_MODRM | C_IMM_P66 : C_ERROR;
+	}
+	return C_ERROR;
+}
+
 unsigned int hde64_disasm(const void *code, hde64s *hs)
 {
 	uint8_t x, c, *p = (uint8_t*)code, cflags, opcode, pref = 0;
 	uint8_t *ht = hde64_table, m_mod, m_reg, m_rm, disp_size = 0;
-	uint8_t op64 = 0;
+	uint8_t op64 = 0, ext = 0;
 
 	memset(hs,0,sizeof(hde64s));
 
@@ -70,15 +103,53 @@ pref_done:
 		}
 	}
 
+	if (IS_VEX(c, p)) {
+		/* the vex prefix encodes 66/f2/f3 and rex itself */
+		if (pref & (PRE_66 | PRE_F2 | PRE_F3 | PRE_LOCK) || hs->flags & F_PREFIX_REX)
+			hs->flags |= F_ERROR | F_ERROR_OPCODE;
+		pref &= ~PRE_66;
+
+		hs->flags |= F_PREFIX_VEX;
+		hs->opcode = c;
+		hs->rex_r = (~*p >> 7) & 1;
+		if (c == 0xc5)
+			hs->vex_map = 1;
+		else {
+			hs->rex_x = (~*p >> 6) & 1;
+			hs->rex_b = (~*p >> 5) & 1;
+			hs->vex_map = *p++ & (c == 0x62 ? 0x07 : 0x1f);
+			hs->rex_w = hs->vex_w = *p >> 7;
+		}
+		hs->vex_vvvv = (~*p >> 3) & 0xf;
+		hs->vex_l = (*p >> 2) & 1;
+		hs->vex_pp = *p++ & 3;
+		if (c == 0x62)
+			hs->vex_l = (*p++ >> 5) & 3;
+
+		hs->opcode2 = opcode = c = *p++;
+		if ((cflags = hde64_vex_cflags(hs->opcode, hs->vex_map, opcode)) == C_ERROR) {
+			hs->flags |= F_ERROR | F_ERROR_OPCODE;
+			cflags = C_MODRM;
+		}
+		ext++;
+		goto opcode_done;
+	}
+
 	if ((hs->opcode = c) == 0x0f) {
 		hs->opcode2 = c = *p++;
 		ht += DELTA_OPCODES;
+		if (c == 0x38 || c == 0x3a) {
+			/* every three byte opcode has a modrm, 0f 3a ones an imm8 as well */
+			hs->opcode3 = opcode = *p++;
+			cflags = c == 0x38 ? C_MODRM : C_MODRM | C_IMM8;
+			ext++;
+			goto opcode_done;
+		}
 	} else if (c >= 0xa0 && c <= 0xa3) {
-		op64++;
-		if (pref & PRE_67)
-			pref |= PRE_66;
-		else
-			pref &= ~PRE_66;
+		/* moffs follows the address size */
+		pref &= ~PRE_66;
+		if (!(pref & PRE_67))
+			op64++;
 	}
 
 	opcode = c;
@@ -106,6 +177,8 @@ error_opcode:
 			hs->flags |= F_ERROR | F_ERROR_OPCODE;
 	}
 
+opcode_done:
+
 	if (cflags & C_MODRM) {
 		hs->flags |= F_MODRM;
 		hs->modrm = c = *p++;
@@ -113,6 +186,13 @@ error_opcode:
 		hs->modrm_rm = m_rm = c & 7;
 		hs->modrm_reg = m_reg = (c & 0x3f) >> 3;
 
+		/* the tables below only cover the one and two byte maps */
+		if (ext) {
+			if (pref & PRE_LOCK)
+				hs->flags |= F_ERROR | F_ERROR_LOCK;
+			goto no_error_operand;
+		}
+
 		if (x && ((x << m_reg) & 0x80))
 			hs->flags |= F_ERROR | F_ERROR_OPCODE;
 
@@ -225,28 +305,23 @@ no_error_operand:
 
 		c = *p++;
 		if (m_reg <= 1) {
-			if (opcode == 0xf6)
+			if (hs->opcode == 0xf6)
 				cflags |= C_IMM8;
-			else if (opcode == 0xf7)
+			else if (hs->opcode == 0xf7)
 				cflags |= C_IMM_P66;
 		}
 
+		/* 67 selects 32 bit addressing in long mode, same modrm layout */
 		switch (m_mod) {
 		case 0:
-			if (pref & PRE_67) {
-				if (m_rm == 6)
-					disp_size = 2;
-			} else
-				if (m_rm == 5)
-					disp_size = 4;
+			if (m_rm == 5)
+				disp_size = 4;
 			break;
 		case 1:
 			disp_size = 1;
 			break;
 		case 2:
-			disp_size = 2;
-			if (!(pref & PRE_67))
-				disp_size <<= 1;
+			disp_size = 4;
 		}
 
 		if (m_mod != 3 && m_rm == 4) {
@@ -330,3 +405,273 @@ disasm_done:
 
 	return (unsigned int)hs->len;
 }
+
+/* legacy prefixes, one bit per byte value */
+static const uint32_t hde64_prefix_map[8] = {
+	0x00000000, 0x40404040, 0x00000000, 0x000000f0,
+	0x00000000, 0x00000000, 0x00000000, 0x000d0000
+};
+
+#define IS_PREFIX(b) ((hde64_prefix_map[(b) >> 5] >> ((b) & 31)) & 1)
+
+/* what the batch decoder keeps beyond the length */
+typedef struct {
+	uint8_t opcode;
+	uint8_t opcode2;
+	uint32_t flags;
+	int32_t rel;
+} hde64_lite;
+
+/*
+ * Shared by hde64_length and hde64_disasm_batch. Same tables and the same
+ * length as hde64_disasm, but none of the validity checks (lock, fpu,
+ * operand) are performed. lite may be NULL, in which case the compiler
+ * drops every store to it.
+ */
+static inline unsigned int hde64_length_core(const uint8_t *code, hde64_lite *lite)
+{
+	const uint8_t *p = code, *ht = hde64_table;
+	uint8_t x = 16, c, cflags, opcode, pref = 0;
+	uint8_t m_mod, m_rm, m_reg, disp_size = 0;
+	uint8_t op64 = 0, opcode2 = 0;
+	uint32_t flags = 0;
+	unsigned int len;
+
+	/* most instructions have no prefix at all, skip the loop for them */
+	while (IS_PREFIX(*p) && x) {
+		if (*p == 0x66)
+			pref |= PRE_66;
+		else if (*p == 0x67)
+			pref |= PRE_67;
+		p++;
+		x--;
+	}
+	c = *p++;
+
+	if (pref & PRE_66)
+		flags |= F_PREFIX_66;
+	if (pref & PRE_67)
+		flags |= F_PREFIX_67;
+
+	if ((c & 0xf0) == 0x40) {
+		flags |= F_PREFIX_REX;
+		if ((c & 0x8) && (*p & 0xf8) == 0xb8)
+			op64++;
+		if (((c = *p++) & 0xf0) == 0x40) {
+			opcode = 0;
+			flags |= F_ERROR | F_ERROR_OPCODE;
+			goto length_done;
+		}
+	}
+
+	opcode = c;
+	if (IS_VEX(c, p)) {
+		uint8_t map = 1;
+
+		flags |= F_PREFIX_VEX;
+		pref &= ~PRE_66;
+		if (c != 0xc5)
+			map = *p++ & (c == 0x62 ? 0x07 : 0x1f);
+		p += c == 0x62 ? 2 : 1;
+
+		opcode2 = c = *p++;
+		if ((cflags = hde64_vex_cflags(opcode, map, c)) == C_ERROR) {
+			flags |= F_ERROR | F_ERROR_OPCODE;
+			cflags = C_MODRM;
+		}
+		goto opcode_done;
+	}
+
+	if (c == 0x0f) {
+		opcode2 = c = *p++;
+		ht += DELTA_OPCODES;
+		if (c == 0x38 || c == 0x3a) {
+			cflags = c == 0x38 ? C_MODRM : C_MODRM | C_IMM8;
+			p++;
+			goto opcode_done;
+		}
+	} else if (c >= 0xa0 && c <= 0xa3) {
+		pref &= ~PRE_66;
+		if (!(pref & PRE_67))
+			op64++;
+	}
+
+	cflags = ht[ht[c / 4] + (c % 4)];
+
+	if (cflags == C_ERROR) {
+		flags |= F_ERROR | F_ERROR_OPCODE;
+		cflags = (c & -3) == 0x24 ? C_MODRM : 0;
+	}
+
+	if (cflags & C_GROUP)
+		cflags = (uint8_t)*(const uint16_t*)(ht + (cflags & 0x7f));
+
+opcode_done:
+
+	if (cflags & C_MODRM) {
+		flags |= F_MODRM;
+		x = *p++;
+		m_mod = x >> 6;
+		m_rm = x & 7;
+		m_reg = (x & 0x3f) >> 3;
+
+		/* mov cr/dr always address a register */
+		if (opcode == 0x0f && c >= 0x20 && c <= 0x23)
+			m_mod = 3;
+
+		if (m_reg <= 1) {
+			if (opcode == 0xf6)
+				cflags |= C_IMM8;
+			else if (opcode == 0xf7)
+				cflags |= C_IMM_P66;
+		}
+
+		switch (m_mod) {
+		case 0:
+			if (m_rm == 5)
+				disp_size = 4;
+			break;
+		case 1:
+			disp_size = 1;
+			break;
+		case 2:
+			disp_size = 4;
+		}
+
+		if (m_mod != 3 && m_rm == 4) {
+			flags |= F_SIB;
+			if ((*p++ & 7) == 5 && !(m_mod & 1))
+				disp_size = 4;
+		}
+
+		flags |= disp_size == 1 ? F_DISP8 : disp_size == 2 ? F_DISP16 : disp_size == 4 ? F_DISP32 : 0;
+		p += disp_size;
+	}
+
+	if (cflags & C_IMM_P66) {
+		if (cflags & C_REL32) {
+			if (pref & PRE_66) {
+				flags |= F_IMM16 | F_RELATIVE;
+				if (lite)
+					lite->rel = *(const int16_t*)p;
+				p += 2;
+			} else {
+				flags |= F_IMM32 | F_RELATIVE;
+				if (lite)
+					lite->rel = *(const int32_t*)p;
+				p += 4;
+			}
+			goto length_done;
+		}
+		if (op64) {
+			flags |= F_IMM64;
+			p += 8;
+		} else if (!(pref & PRE_66)) {
+			flags |= F_IMM32;
+			p += 4;
+		} else {
+			flags |= F_IMM16;
+			p += 2;
+			goto imm16_done;
+		}
+	}
+
+	if (cflags & C_IMM16) {
+		flags |= F_IMM16;
+		p += 2;
+	}
+imm16_done:
+	if (cflags & C_IMM8) {
+		flags |= F_IMM8;
+		p++;
+	}
+
+	if (cflags & C_REL32) {
+		flags |= F_IMM32 | F_RELATIVE;
+		if (lite)
+			lite->rel = *(const int32_t*)p;
+		p += 4;
+	} else if (cflags & C_REL8) {
+		flags |= F_IMM8 | F_RELATIVE;
+		if (lite)
+			lite->rel = *(const int8_t*)p;
+		p++;
+	}
+
+length_done:
+
+	if ((len = (unsigned int)(p - code)) > 15) {
+		flags |= F_ERROR | F_ERROR_LENGTH;
+		len = 15;
+	}
+
+	if (lite) {
+		lite->opcode = opcode;
+		lite->opcode2 = opcode2;
+		lite->flags = flags;
+	}
+
+	return len;
+}
+
+unsigned int hde64_length(const void *code)
+{
+	return hde64_length_core((const uint8_t*)code, NULL);
+}
+
+unsigned int hde64_length_cover(const void *code, unsigned int size)
+{
+	const uint8_t *p = (const uint8_t*)code;
+	unsigned int total = 0;
+
+	while (total < size)
+		total += hde64_length_core(p + total, NULL);
+
+	return total;
+}
+
+size_t hde64_disasm_batch(const void *code, size_t size, uint64_t base, hde64_batch *batch)
+{
+	const uint8_t *p = (const uint8_t*)code;
+	uint8_t tail[32];
+	size_t off = 0;
+	uint32_t n = 0;
+
+	while (off < size && n < batch->capacity) {
+		const uint8_t *insn = p + off;
+		hde64_lite lite;
+		unsigned int len;
+
+		/* the decoder may look up to 31 bytes ahead, pad the end of the buffer */
+		if (size - off < sizeof(tail)) {
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, insn, size - off);
+			insn = tail;
+		}
+
+		lite.rel = 0;
+		len = hde64_length_core(insn, &lite);
+
+		if (off + len > size)
+			break;
+
+		if (batch->offset)
+			batch->offset[n] = (uint32_t)off;
+		if (batch->len)
+			batch->len[n] = (uint8_t)len;
+		if (batch->opcode)
+			batch->opcode[n] = lite.opcode;
+		if (batch->opcode2)
+			batch->opcode2[n] = lite.opcode2;
+		if (batch->flags)
+			batch->flags[n] = lite.flags;
+		if (batch->target)
+			batch->target[n] = (lite.flags & F_RELATIVE) ? base + off + len + (int64_t)lite.rel : 0;
+
+		off += len;
+		n++;
+	}
+
+	batch->count = n;
+	return off;
+}